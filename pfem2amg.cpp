@@ -0,0 +1,346 @@
+#include "pfem2amg.h"
+
+#include <cmath>
+#include <algorithm>
+
+pfem2AMGPreconditioner::AdditionalData::AdditionalData(const double strong_threshold, const unsigned int max_coarse_size, const unsigned int smoother_sweeps, const double prolongator_damping)
+	: strong_threshold(strong_threshold)
+	, max_coarse_size(max_coarse_size)
+	, smoother_sweeps(smoother_sweeps)
+	, prolongator_damping(prolongator_damping)
+{}
+
+void pfem2AMGPreconditioner::CSRMatrix::transpose(CSRMatrix &result) const
+{
+	result.n_rows = n_cols;
+	result.n_cols = n_rows;
+	result.row_start.assign(n_cols + 1, 0);
+	result.columns.resize(columns.size());
+	result.values.resize(values.size());
+
+	for (unsigned int k = 0; k < columns.size(); ++k) ++result.row_start[columns[k] + 1];
+	for (unsigned int i = 0; i < n_cols; ++i) result.row_start[i + 1] += result.row_start[i];
+
+	std::vector<unsigned int> position(result.row_start.begin(), result.row_start.end() - 1);
+	for (unsigned int i = 0; i < n_rows; ++i)
+		for (unsigned int k = row_start[i]; k < row_start[i + 1]; ++k){
+			const unsigned int destination = position[columns[k]]++;
+			result.columns[destination] = i;
+			result.values[destination] = values[k];
+		}
+}
+
+void pfem2AMGPreconditioner::CSRMatrix::multiply(const CSRMatrix &other, CSRMatrix &result) const
+{
+	result.n_rows = n_rows;
+	result.n_cols = other.n_cols;
+	result.row_start.assign(1, 0);
+	result.columns.clear();
+	result.values.clear();
+
+	//разреженный аккумулятор строки результата
+	std::vector<unsigned int> marker(other.n_cols, numbers::invalid_unsigned_int);
+	std::vector<double> accumulator(other.n_cols, 0.0);
+
+	for (unsigned int i = 0; i < n_rows; ++i){
+		const unsigned int rowBegin = result.columns.size();
+
+		for (unsigned int k = row_start[i]; k < row_start[i + 1]; ++k){
+			const unsigned int j = columns[k];
+
+			for (unsigned int l = other.row_start[j]; l < other.row_start[j + 1]; ++l){
+				const unsigned int column = other.columns[l];
+
+				if(marker[column] != i){
+					marker[column] = i;
+					accumulator[column] = 0.0;
+					result.columns.push_back(column);
+				}
+
+				accumulator[column] += values[k] * other.values[l];
+			}
+		}
+
+		for (unsigned int k = rowBegin; k < result.columns.size(); ++k) result.values.push_back(accumulator[result.columns[k]]);
+		result.row_start.push_back(result.columns.size());
+	}
+}
+
+void pfem2AMGPreconditioner::CSRMatrix::vmult(std::vector<double> &y, const std::vector<double> &x, const bool add) const
+{
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < static_cast<int>(n_rows); ++i){
+		double sum = add ? y[i] : 0.0;
+		for (unsigned int k = row_start[i]; k < row_start[i + 1]; ++k) sum += values[k] * x[columns[k]];
+		y[i] = sum;
+	}
+}
+
+void pfem2AMGPreconditioner::CSRMatrix::residual(std::vector<double> &r, const std::vector<double> &x, const std::vector<double> &b) const
+{
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < static_cast<int>(n_rows); ++i){
+		double sum = b[i];
+		for (unsigned int k = row_start[i]; k < row_start[i + 1]; ++k) sum -= values[k] * x[columns[k]];
+		r[i] = sum;
+	}
+}
+
+void pfem2AMGPreconditioner::initialize(const SparseMatrix<double> &matrix, const AdditionalData &additional_data)
+{
+	data = additional_data;
+	levels.clear();
+	levels.resize(1);
+
+	CSRMatrix &fine = levels[0].matrix;
+	fine.n_rows = matrix.m();
+	fine.n_cols = matrix.n();
+	fine.row_start.assign(1, 0);
+	fine.columns.clear();
+	fine.values.clear();
+
+	for (unsigned int row = 0; row < fine.n_rows; ++row){
+		for (SparseMatrix<double>::const_iterator it = matrix.begin(row); it != matrix.end(row); ++it){
+			fine.columns.push_back(it->column());
+			fine.values.push_back(it->value());
+		}
+
+		fine.row_start.push_back(fine.columns.size());
+	}
+
+	for (;;){
+		Level &level = levels.back();
+		const CSRMatrix &A = level.matrix;
+
+		level.diagonal.assign(A.n_rows, 0.0);
+		for (unsigned int i = 0; i < A.n_rows; ++i)
+			for (unsigned int k = A.row_start[i]; k < A.row_start[i + 1]; ++k)
+				if(A.columns[k] == i) level.diagonal[i] += A.values[k];
+
+		level.solution.assign(A.n_rows, 0.0);
+		level.rhs.assign(A.n_rows, 0.0);
+		level.residual.assign(A.n_rows, 0.0);
+
+		if(A.n_rows <= data.max_coarse_size) break;
+
+		build_prolongation(level, level.prolongation);
+
+		//агрегация не уменьшает уровень заметно - дальнейшее огрубление бесполезно
+		if(level.prolongation.n_cols == 0 || 10 * level.prolongation.n_cols > 9 * A.n_rows){
+			level.prolongation = CSRMatrix();
+			break;
+		}
+
+		level.prolongation.transpose(level.restriction);
+
+		Level coarse;
+		CSRMatrix AP;
+		A.multiply(level.prolongation, AP);
+		level.restriction.multiply(AP, coarse.matrix);
+
+		levels.push_back(coarse);
+	}
+
+	//грубейший уровень решается прямым методом, если он достаточно мал
+	const Level &coarsest = levels.back();
+	coarse_inverse = FullMatrix<double>();
+
+	if(coarsest.matrix.n_rows > 0 && coarsest.matrix.n_rows <= data.max_coarse_size){
+		coarse_inverse = FullMatrix<double>(coarsest.matrix.n_rows, coarsest.matrix.n_rows);
+
+		for (unsigned int i = 0; i < coarsest.matrix.n_rows; ++i)
+			for (unsigned int k = coarsest.matrix.row_start[i]; k < coarsest.matrix.row_start[i + 1]; ++k)
+				coarse_inverse(i, coarsest.matrix.columns[k]) += coarsest.matrix.values[k];
+
+		coarse_inverse.gauss_jordan();
+	}
+}
+
+void pfem2AMGPreconditioner::build_prolongation(const Level &level, CSRMatrix &prolongation) const
+{
+	const CSRMatrix &A = level.matrix;
+	const unsigned int n = A.n_rows;
+	const unsigned int unassigned = numbers::invalid_unsigned_int;
+
+	//сильные связи узлов
+	std::vector<unsigned int> strong_start(1, 0), strong;
+	std::vector<double> strong_values;
+
+	for (unsigned int i = 0; i < n; ++i){
+		for (unsigned int k = A.row_start[i]; k < A.row_start[i + 1]; ++k){
+			const unsigned int j = A.columns[k];
+
+			if(j != i && std::fabs(A.values[k]) >= data.strong_threshold * std::sqrt(std::fabs(level.diagonal[i] * level.diagonal[j])) && A.values[k] != 0.0){
+				strong.push_back(j);
+				strong_values.push_back(std::fabs(A.values[k]));
+			}
+		}
+
+		strong_start.push_back(strong.size());
+	}
+
+	std::vector<unsigned int> aggregate(n, unassigned);
+	unsigned int n_aggregates = 0;
+
+	//1: узел, все сильные соседи которого свободны, образует агрегат вместе с ними
+	for (unsigned int i = 0; i < n; ++i){
+		if(aggregate[i] != unassigned || strong_start[i] == strong_start[i + 1]) continue;
+
+		bool free_neighbourhood = true;
+		for (unsigned int k = strong_start[i]; k < strong_start[i + 1] && free_neighbourhood; ++k)
+			free_neighbourhood = aggregate[strong[k]] == unassigned;
+
+		if(!free_neighbourhood) continue;
+
+		aggregate[i] = n_aggregates;
+		for (unsigned int k = strong_start[i]; k < strong_start[i + 1]; ++k) aggregate[strong[k]] = n_aggregates;
+		++n_aggregates;
+	}
+
+	//2: оставшиеся узлы присоединяются к агрегату самого сильного соседа (по результатам шага 1)
+	const std::vector<unsigned int> first_pass(aggregate);
+	for (unsigned int i = 0; i < n; ++i){
+		if(aggregate[i] != unassigned) continue;
+
+		double max_strength = 0.0;
+		for (unsigned int k = strong_start[i]; k < strong_start[i + 1]; ++k)
+			if(first_pass[strong[k]] != unassigned && strong_values[k] > max_strength){
+				max_strength = strong_values[k];
+				aggregate[i] = first_pass[strong[k]];
+			}
+	}
+
+	//3: из узлов, так и не попавших в агрегаты, образуются новые агрегаты
+	for (unsigned int i = 0; i < n; ++i){
+		if(aggregate[i] != unassigned || strong_start[i] == strong_start[i + 1]) continue;
+
+		aggregate[i] = n_aggregates;
+		for (unsigned int k = strong_start[i]; k < strong_start[i + 1]; ++k)
+			if(aggregate[strong[k]] == unassigned) aggregate[strong[k]] = n_aggregates;
+		++n_aggregates;
+	}
+
+	//узлы без сильных связей (строки ГУ) остаются вне агрегатов
+
+	//оценка спектрального радиуса D^-1 A по кругам Гершгорина
+	double spectral_radius = 0.0;
+	for (unsigned int i = 0; i < n; ++i){
+		if(aggregate[i] == unassigned || level.diagonal[i] == 0.0) continue;
+
+		double row_sum = 0.0;
+		for (unsigned int k = A.row_start[i]; k < A.row_start[i + 1]; ++k) row_sum += std::fabs(A.values[k]);
+		spectral_radius = std::max(spectral_radius, row_sum / std::fabs(level.diagonal[i]));
+	}
+
+	const double omega = spectral_radius > 0.0 ? data.prolongator_damping / spectral_radius : 0.0;
+
+	//P = (I - omega D^-1 A) T, T - кусочно-постоянный интерполянт по агрегатам
+	prolongation.n_rows = n;
+	prolongation.n_cols = n_aggregates;
+	prolongation.row_start.assign(1, 0);
+	prolongation.columns.clear();
+	prolongation.values.clear();
+
+	std::vector<unsigned int> marker(n_aggregates, unassigned);
+	std::vector<double> accumulator(n_aggregates, 0.0);
+
+	for (unsigned int i = 0; i < n; ++i){
+		const unsigned int rowBegin = prolongation.columns.size();
+
+		if(aggregate[i] != unassigned){
+			marker[aggregate[i]] = i;
+			accumulator[aggregate[i]] = 1.0;
+			prolongation.columns.push_back(aggregate[i]);
+
+			const double scale = omega / level.diagonal[i];
+
+			for (unsigned int k = A.row_start[i]; k < A.row_start[i + 1]; ++k){
+				const unsigned int column = aggregate[A.columns[k]];
+				if(column == unassigned) continue;
+
+				if(marker[column] != i){
+					marker[column] = i;
+					accumulator[column] = 0.0;
+					prolongation.columns.push_back(column);
+				}
+
+				accumulator[column] -= scale * A.values[k];
+			}
+		}
+
+		for (unsigned int k = rowBegin; k < prolongation.columns.size(); ++k) prolongation.values.push_back(accumulator[prolongation.columns[k]]);
+		prolongation.row_start.push_back(prolongation.columns.size());
+	}
+}
+
+void pfem2AMGPreconditioner::smooth(const Level &level, const bool forward) const
+{
+	const CSRMatrix &A = level.matrix;
+	const int n = A.n_rows;
+
+	for (unsigned int sweep = 0; sweep < data.smoother_sweeps; ++sweep)
+		for (int step = 0; step < n; ++step){
+			const unsigned int i = forward ? step : n - 1 - step;
+			if(level.diagonal[i] == 0.0) continue;
+
+			double sum = level.rhs[i];
+			for (unsigned int k = A.row_start[i]; k < A.row_start[i + 1]; ++k)
+				if(A.columns[k] != i) sum -= A.values[k] * level.solution[A.columns[k]];
+
+			level.solution[i] = sum / level.diagonal[i];
+		}
+}
+
+void pfem2AMGPreconditioner::v_cycle(const unsigned int levelIndex) const
+{
+	const Level &level = levels[levelIndex];
+
+	if(levelIndex + 1 == levels.size()){
+		if(coarse_inverse.m() > 0){
+			for (unsigned int i = 0; i < coarse_inverse.m(); ++i){
+				double sum = 0.0;
+				for (unsigned int j = 0; j < coarse_inverse.n(); ++j) sum += coarse_inverse(i, j) * level.rhs[j];
+				level.solution[i] = sum;
+			}
+		} else {
+			std::fill(level.solution.begin(), level.solution.end(), 0.0);
+			smooth(level, true);
+			smooth(level, false);
+		}
+
+		return;
+	}
+
+	const Level &coarse = levels[levelIndex + 1];
+
+	std::fill(level.solution.begin(), level.solution.end(), 0.0);
+	smooth(level, true);
+
+	level.matrix.residual(level.residual, level.solution, level.rhs);
+	level.restriction.vmult(coarse.rhs, level.residual);
+
+	v_cycle(levelIndex + 1);
+
+	level.prolongation.vmult(level.solution, coarse.solution, true);
+	smooth(level, false);
+}
+
+void pfem2AMGPreconditioner::vmult(Vector<double> &dst, const Vector<double> &src) const
+{
+	if(levels.empty()){
+		dst = src;
+		return;
+	}
+
+	const Level &fine = levels[0];
+	for (unsigned int i = 0; i < fine.matrix.n_rows; ++i) fine.rhs[i] = src(i);
+
+	v_cycle(0);
+
+	for (unsigned int i = 0; i < fine.matrix.n_rows; ++i) dst(i) = fine.solution[i];
+}
+
+unsigned int pfem2AMGPreconditioner::n_levels() const
+{
+	return levels.size();
+}
@@ -0,0 +1,74 @@
+#ifndef PFEM2AMG_H
+#define PFEM2AMG_H
+
+#include <vector>
+
+#include <deal.II/base/subscriptor.h>
+#include <deal.II/lac/full_matrix.h>
+#include <deal.II/lac/sparse_matrix.h>
+#include <deal.II/lac/vector.h>
+
+using namespace dealii;
+
+/*!
+ * \brief Алгебраический многосеточный предобусловливатель (сглаженная агрегация) для симметричных положительно определенных матриц
+ *
+ * Используется для уравнения для давления, если deal.II собран без Trilinos. Иерархия строится один раз в initialize():
+ * узлы агрегируются по сильным связям, кусочно-постоянный интерполянт сглаживается шагом метода Якоби, грубая матрица - P^T A P.
+ * vmult() выполняет один V-цикл (симметричный метод Гаусса-Зейделя: прямой ход до перехода на грубый уровень, обратный - после),
+ * поэтому предобусловливатель симметричен и подходит для метода сопряженных градиентов.
+ * Строки, содержащие только диагональный элемент (исключенные ГУ), в агрегаты не входят и полностью разрешаются сглаживателем.
+ */
+class pfem2AMGPreconditioner : public Subscriptor
+{
+public:
+	struct AdditionalData
+	{
+		AdditionalData(const double strong_threshold = 0.02, const unsigned int max_coarse_size = 500, const unsigned int smoother_sweeps = 2, const double prolongator_damping = 4.0 / 3.0);
+
+		double strong_threshold;			//!< Порог сильной связи: |a_ij| >= strong_threshold * sqrt(|a_ii * a_jj|)
+		unsigned int max_coarse_size;		//!< Размер грубейшего уровня, на котором система решается прямым методом
+		unsigned int smoother_sweeps;		//!< Число итераций сглаживателя до и после перехода на грубый уровень
+		double prolongator_damping;			//!< Параметр сглаживания интерполянта (делится на оценку спектрального радиуса D^-1 A)
+	};
+
+	void initialize(const SparseMatrix<double> &matrix, const AdditionalData &additional_data = AdditionalData());
+	void vmult(Vector<double> &dst, const Vector<double> &src) const;
+
+	unsigned int n_levels() const;
+
+private:
+	//! Разреженная матрица в формате CSR
+	struct CSRMatrix
+	{
+		unsigned int n_rows, n_cols;
+		std::vector<unsigned int> row_start;
+		std::vector<unsigned int> columns;
+		std::vector<double> values;
+
+		void transpose(CSRMatrix &result) const;
+		void multiply(const CSRMatrix &other, CSRMatrix &result) const;			//!< result = this * other
+		void vmult(std::vector<double> &y, const std::vector<double> &x, const bool add = false) const;	//!< y = this * x (или y += this * x)
+		void residual(std::vector<double> &r, const std::vector<double> &x, const std::vector<double> &b) const;	//!< r = b - this * x
+	};
+
+	struct Level
+	{
+		CSRMatrix matrix;
+		CSRMatrix prolongation;			//!< Интерполяция с грубого уровня (n_rows x n_coarse)
+		CSRMatrix restriction;			//!< Транспонированная интерполяция
+		std::vector<double> diagonal;
+
+		mutable std::vector<double> solution, rhs, residual;
+	};
+
+	void build_prolongation(const Level &level, CSRMatrix &prolongation) const;	//!< Агрегация узлов уровня и сглаженный интерполянт
+	void smooth(const Level &level, const bool forward) const;
+	void v_cycle(const unsigned int level) const;
+
+	AdditionalData data;
+	std::vector<Level> levels;
+	FullMatrix<double> coarse_inverse;			//!< Обратная матрица грубейшего уровня
+};
+
+#endif // PFEM2AMG_H
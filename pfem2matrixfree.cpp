@@ -0,0 +1,414 @@
+#include "pfem2matrixfree.h"
+
+template <int fe_degree>
+pfem2MatrixFreeOperator<fe_degree>::pfem2MatrixFreeOperator()
+	: dof_index(0)
+	, mass_factor(0.0)
+	, has_diffusion(false)
+	, current_diagonal(0)
+{}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::initialize(const std::shared_ptr<const MatrixFree<3,double>> &data, const unsigned int data_dof_index)
+{
+	matrix_free = data;
+	dof_index = data_dof_index;
+
+	matrix_free->initialize_dof_vector(inverse_diagonal, dof_index);
+	matrix_free->initialize_dof_vector(boundary_lifting, dof_index);
+	matrix_free->initialize_dof_vector(src_free, dof_index);
+	matrix_free->initialize_dof_vector(dst_add, dof_index);
+
+	//коэффициенты еще не заданы - диагональ будет вычислена в set_coefficients()
+	cached_diagonals.clear();
+	constrained_values.clear();
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::set_coefficients(const double new_mass_factor, const Tensor<1,3> &new_diffusion)
+{
+	if(!cached_diagonals.empty() && new_mass_factor == mass_factor && new_diffusion == diffusion) return;
+
+	mass_factor = new_mass_factor;
+	diffusion = new_diffusion;
+	has_diffusion = diffusion.norm_square() != 0.0;
+
+	//системы для компонент скорости чередуют коэффициенты прогноза и поправки - диагональ вычисляется один раз для каждого набора
+	for (current_diagonal = 0; current_diagonal < cached_diagonals.size(); ++current_diagonal)
+		if(cached_diagonals[current_diagonal].mass_factor == mass_factor && cached_diagonals[current_diagonal].diffusion == diffusion) break;
+
+	if(current_diagonal == cached_diagonals.size()){
+		cached_diagonals.emplace_back();
+		CoefficientsDiagonal &cached = cached_diagonals.back();
+		cached.mass_factor = mass_factor;
+		cached.diffusion = diffusion;
+
+		const unsigned int dummy = 0;
+		matrix_free->initialize_dof_vector(cached.inverse_diagonal, dof_index);
+		matrix_free->cell_loop(&pfem2MatrixFreeOperator::local_compute_diagonal, this, cached.inverse_diagonal, dummy);
+
+		for (unsigned int i = 0; i < cached.inverse_diagonal.size(); ++i)
+			cached.inverse_diagonal(i) = cached.inverse_diagonal(i) != 0.0 ? 1.0 / cached.inverse_diagonal(i) : 1.0;
+	}
+
+	update_inverse_diagonal();
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::reset_boundary_values()
+{
+	constrained_values.clear();
+	update_inverse_diagonal();
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::apply_boundary_values(const std::map<types::global_dof_index,double> &boundary_values, Vector<double> &solution, Vector<double> &rhs)
+{
+	//вклад столбцов с ГУ переносится в правую часть; для узла, уже имеющего ГУ, переносится только изменение значения
+	Vector<double> &boundary_increment = src_free;
+	boundary_increment = 0.0;
+
+	for (std::map<types::global_dof_index,double>::const_iterator it = boundary_values.begin(); it != boundary_values.end(); ++it){
+		std::map<types::global_dof_index,double>::iterator constrained = constrained_values.find(it->first);
+
+		if(constrained == constrained_values.end()){
+			boundary_increment(it->first) = it->second;
+			constrained_values.emplace(it->first, it->second);
+		} else {
+			boundary_increment(it->first) = it->second - constrained->second;
+			constrained->second = it->second;
+		}
+	}
+
+	apply(boundary_lifting, boundary_increment);
+	rhs -= boundary_lifting;
+
+	for (std::map<types::global_dof_index,double>::const_iterator it = constrained_values.begin(); it != constrained_values.end(); ++it){
+		rhs(it->first) = it->second;
+		solution(it->first) = it->second;
+	}
+
+	update_inverse_diagonal();
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::set_zero_boundary_values(const IndexSet &indices)
+{
+	constrained_values.clear();
+	for (IndexSet::ElementIterator it = indices.begin(); it != indices.end(); ++it) constrained_values.emplace(*it, 0.0);
+
+	update_inverse_diagonal();
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::update_inverse_diagonal()
+{
+	inverse_diagonal = cached_diagonals[current_diagonal].inverse_diagonal;
+	for (std::map<types::global_dof_index,double>::const_iterator it = constrained_values.begin(); it != constrained_values.end(); ++it) inverse_diagonal(it->first) = 1.0;
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::evaluate_cell(CellEvaluation &phi, const double cell_mass_factor, const bool with_diffusion) const
+{
+	const bool with_mass = cell_mass_factor != 0.0;
+
+	phi.evaluate(with_mass, with_diffusion);
+
+	for (unsigned int q = 0; q < phi.n_q_points; ++q){
+		if(with_mass) phi.submit_value(cell_mass_factor * phi.get_value(q), q);
+
+		if(with_diffusion){
+			Tensor<1,3,VectorizedArray<double>> gradient = phi.get_gradient(q);
+			for (unsigned int d = 0; d < 3; ++d) gradient[d] *= diffusion[d];
+			phi.submit_gradient(gradient, q);
+		}
+	}//q
+
+	phi.integrate(with_mass, with_diffusion);
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::local_apply(const MatrixFree<3,double> &data, Vector<double> &dst, const Vector<double> &src, const std::pair<unsigned int,unsigned int> &cell_range) const
+{
+	CellEvaluation phi(data, dof_index);
+
+	for (unsigned int cell = cell_range.first; cell < cell_range.second; ++cell){
+		phi.reinit(cell);
+		phi.read_dof_values(src);
+		evaluate_cell(phi, mass_factor, has_diffusion);
+		phi.distribute_local_to_global(dst);
+	}//cell
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::local_apply_mass(const MatrixFree<3,double> &data, Vector<double> &dst, const Vector<double> &src, const std::pair<unsigned int,unsigned int> &cell_range) const
+{
+	CellEvaluation phi(data, dof_index);
+
+	for (unsigned int cell = cell_range.first; cell < cell_range.second; ++cell){
+		phi.reinit(cell);
+		phi.read_dof_values(src);
+		evaluate_cell(phi, 1.0, false);
+		phi.distribute_local_to_global(dst);
+	}//cell
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::local_compute_diagonal(const MatrixFree<3,double> &data, Vector<double> &dst, const unsigned int &, const std::pair<unsigned int,unsigned int> &cell_range) const
+{
+	CellEvaluation phi(data, dof_index);
+	AlignedVector<VectorizedArray<double>> local_diagonal(phi.dofs_per_cell);
+
+	for (unsigned int cell = cell_range.first; cell < cell_range.second; ++cell){
+		phi.reinit(cell);
+
+		//i-й диагональный элемент - i-я компонента действия оператора на i-й базисный вектор ячейки
+		for (unsigned int i = 0; i < phi.dofs_per_cell; ++i){
+			for (unsigned int j = 0; j < phi.dofs_per_cell; ++j) phi.begin_dof_values()[j] = make_vectorized_array(0.0);
+			phi.begin_dof_values()[i] = make_vectorized_array(1.0);
+
+			evaluate_cell(phi, mass_factor, has_diffusion);
+			local_diagonal[i] = phi.begin_dof_values()[i];
+		}
+
+		for (unsigned int i = 0; i < phi.dofs_per_cell; ++i) phi.begin_dof_values()[i] = local_diagonal[i];
+		phi.distribute_local_to_global(dst);
+	}//cell
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::vmult(Vector<double> &dst, const Vector<double> &src) const
+{
+	//строки и столбцы с ГУ исключены: значения src в этих узлах не участвуют в обходе ячеек и переносятся в dst
+	src_free = src;
+	for (std::map<types::global_dof_index,double>::const_iterator it = constrained_values.begin(); it != constrained_values.end(); ++it) src_free(it->first) = 0.0;
+
+	dst = 0.0;
+	matrix_free->cell_loop(&pfem2MatrixFreeOperator::local_apply, this, dst, src_free);
+
+	for (std::map<types::global_dof_index,double>::const_iterator it = constrained_values.begin(); it != constrained_values.end(); ++it) dst(it->first) = src(it->first);
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::vmult_add(Vector<double> &dst, const Vector<double> &src) const
+{
+	vmult(dst_add, src);
+	dst += dst_add;
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::Tvmult(Vector<double> &dst, const Vector<double> &src) const
+{
+	vmult(dst, src);
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::Tvmult_add(Vector<double> &dst, const Vector<double> &src) const
+{
+	vmult_add(dst, src);
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::apply(Vector<double> &dst, const Vector<double> &src) const
+{
+	dst = 0.0;
+	matrix_free->cell_loop(&pfem2MatrixFreeOperator::local_apply, this, dst, src);
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::apply_mass(Vector<double> &dst, const Vector<double> &src) const
+{
+	dst = 0.0;
+	matrix_free->cell_loop(&pfem2MatrixFreeOperator::local_apply_mass, this, dst, src);
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeOperator<fe_degree>::precondition_Jacobi(Vector<double> &dst, const Vector<double> &src, const double omega) const
+{
+	for (unsigned int i = 0; i < src.size(); ++i) dst(i) = omega * inverse_diagonal(i) * src(i);
+}
+
+template <int fe_degree>
+std::shared_ptr<DiagonalMatrix<Vector<double>>> pfem2MatrixFreeOperator<fe_degree>::get_matrix_diagonal_inverse() const
+{
+	std::shared_ptr<DiagonalMatrix<Vector<double>>> diagonal_inverse(new DiagonalMatrix<Vector<double>>());
+	diagonal_inverse->get_vector() = inverse_diagonal;
+
+	return diagonal_inverse;
+}
+
+template <int fe_degree>
+unsigned int pfem2MatrixFreeOperator<fe_degree>::m() const
+{
+	return inverse_diagonal.size();
+}
+
+template <int fe_degree>
+unsigned int pfem2MatrixFreeOperator<fe_degree>::n() const
+{
+	return inverse_diagonal.size();
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeExplicitOperators<fe_degree>::initialize(const std::shared_ptr<const MatrixFree<3,double>> &data, const std::set<types::boundary_id> new_stress_flux_boundaries[3],
+	const std::set<types::boundary_id> &new_velocity_flux_boundaries)
+{
+	matrix_free = data;
+
+	for (unsigned int a = 0; a < 3; ++a) stress_flux_boundaries[a] = new_stress_flux_boundaries[a];
+	velocity_flux_boundaries = new_velocity_flux_boundaries;
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeExplicitOperators<fe_degree>::apply_viscous_coupling(BlockVector<double> &dst, const BlockVector<double> &velocity) const
+{
+	matrix_free->loop(&pfem2MatrixFreeExplicitOperators::local_viscous_coupling,
+		&pfem2MatrixFreeExplicitOperators::template local_no_inner_faces<BlockVector<double>, BlockVector<double>>,
+		&pfem2MatrixFreeExplicitOperators::local_viscous_coupling_boundary, this, dst, velocity, true);
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeExplicitOperators<fe_degree>::apply_pressure_gradient(BlockVector<double> &dst, const Vector<double> &pressure) const
+{
+	dst = 0.0;
+	matrix_free->cell_loop(&pfem2MatrixFreeExplicitOperators::local_pressure_gradient, this, dst, pressure);
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeExplicitOperators<fe_degree>::apply_divergence(Vector<double> &dst, const BlockVector<double> &velocity) const
+{
+	matrix_free->loop(&pfem2MatrixFreeExplicitOperators::local_divergence,
+		&pfem2MatrixFreeExplicitOperators::template local_no_inner_faces<Vector<double>, BlockVector<double>>,
+		&pfem2MatrixFreeExplicitOperators::local_divergence_boundary, this, dst, velocity, true);
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeExplicitOperators<fe_degree>::local_viscous_coupling(const MatrixFree<3,double> &data, BlockVector<double> &dst, const BlockVector<double> &src, const std::pair<unsigned int,unsigned int> &cell_range) const
+{
+	VelocityEvaluation phi(data, 0);
+
+	for (unsigned int cell = cell_range.first; cell < cell_range.second; ++cell){
+		phi.reinit(cell);
+		phi.read_dof_values(src);
+		phi.evaluate(false, true);
+
+		for (unsigned int q = 0; q < phi.n_q_points; ++q){
+			//grad[c][d] = dVc/dxd
+			const Tensor<2,3,VectorizedArray<double>> grad = phi.get_gradient(q);
+			const VectorizedArray<double> divergence = grad[0][0] + grad[1][1] + grad[2][2];
+
+			//явная часть tau_ij в уравнении для компоненты a: -(dN_i/dx_c, dVc/dx_a) + 2/3 (dN_i/dx_a, dVc/dx_c), c != a
+			Tensor<2,3,VectorizedArray<double>> flux;
+			for (unsigned int a = 0; a < 3; ++a)
+				for (unsigned int d = 0; d < 3; ++d) flux[a][d] = d == a ? 2.0/3.0 * (divergence - grad[a][a]) : -grad[d][a];
+
+			phi.submit_gradient(flux, q);
+		}//q
+
+		phi.integrate(false, true);
+		phi.distribute_local_to_global(dst);
+	}//cell
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeExplicitOperators<fe_degree>::local_viscous_coupling_boundary(const MatrixFree<3,double> &data, BlockVector<double> &dst, const BlockVector<double> &src, const std::pair<unsigned int,unsigned int> &face_range) const
+{
+	VelocityFaceEvaluation phi(data, true, 0);
+
+	for (unsigned int face = face_range.first; face < face_range.second; ++face){
+		const types::boundary_id boundary_id = data.get_boundary_id(face);
+
+		bool stress_flux[3];
+		for (unsigned int a = 0; a < 3; ++a) stress_flux[a] = stress_flux_boundaries[a].count(boundary_id) > 0;
+		if(!stress_flux[0] && !stress_flux[1] && !stress_flux[2]) continue;
+
+		phi.reinit(face);
+		phi.read_dof_values(src);
+		phi.evaluate(false, true);
+
+		for (unsigned int q = 0; q < phi.n_q_points; ++q){
+			const Tensor<2,3,VectorizedArray<double>> grad = phi.get_gradient(q);
+			const Tensor<1,3,VectorizedArray<double>> normal = phi.get_normal_vector(q);
+			const VectorizedArray<double> divergence = grad[0][0] + grad[1][1] + grad[2][2];
+
+			//tau_ab * n_b = (dVa/dxb + dVb/dxa - 2/3 delta_ab div V) * n_b
+			Tensor<1,3,VectorizedArray<double>> stress;
+			for (unsigned int a = 0; a < 3; ++a){
+				if(!stress_flux[a]) continue;
+
+				for (unsigned int b = 0; b < 3; ++b) stress[a] += (grad[a][b] + grad[b][a]) * normal[b];
+				stress[a] -= 2.0/3.0 * divergence * normal[a];
+			}
+
+			phi.submit_value(stress, q);
+		}//q
+
+		phi.integrate(true, false);
+		phi.distribute_local_to_global(dst);
+	}//face
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeExplicitOperators<fe_degree>::local_pressure_gradient(const MatrixFree<3,double> &data, BlockVector<double> &dst, const Vector<double> &src, const std::pair<unsigned int,unsigned int> &cell_range) const
+{
+	VelocityEvaluation phi(data, 0);
+	PressureEvaluation phi_p(data, 1);
+
+	for (unsigned int cell = cell_range.first; cell < cell_range.second; ++cell){
+		phi_p.reinit(cell);
+		phi_p.read_dof_values(src);
+		phi_p.evaluate(false, true);
+
+		phi.reinit(cell);
+		for (unsigned int q = 0; q < phi.n_q_points; ++q) phi.submit_value(phi_p.get_gradient(q), q);
+
+		phi.integrate(true, false);
+		phi.distribute_local_to_global(dst);
+	}//cell
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeExplicitOperators<fe_degree>::local_divergence(const MatrixFree<3,double> &data, Vector<double> &dst, const BlockVector<double> &src, const std::pair<unsigned int,unsigned int> &cell_range) const
+{
+	VelocityEvaluation phi(data, 0);
+	PressureEvaluation phi_p(data, 1);
+
+	for (unsigned int cell = cell_range.first; cell < cell_range.second; ++cell){
+		phi.reinit(cell);
+		phi.read_dof_values(src);
+		phi.evaluate(true, false);
+
+		phi_p.reinit(cell);
+		for (unsigned int q = 0; q < phi_p.n_q_points; ++q) phi_p.submit_gradient(phi.get_value(q), q);
+
+		phi_p.integrate(false, true);
+		phi_p.distribute_local_to_global(dst);
+	}//cell
+}
+
+template <int fe_degree>
+void pfem2MatrixFreeExplicitOperators<fe_degree>::local_divergence_boundary(const MatrixFree<3,double> &data, Vector<double> &dst, const BlockVector<double> &src, const std::pair<unsigned int,unsigned int> &face_range) const
+{
+	VelocityFaceEvaluation phi(data, true, 0);
+	PressureFaceEvaluation phi_p(data, true, 1);
+
+	for (unsigned int face = face_range.first; face < face_range.second; ++face){
+		if(velocity_flux_boundaries.count(data.get_boundary_id(face)) == 0) continue;
+
+		phi.reinit(face);
+		phi.read_dof_values(src);
+		phi.evaluate(true, false);
+
+		phi_p.reinit(face);
+		for (unsigned int q = 0; q < phi_p.n_q_points; ++q) phi_p.submit_value(-(phi.get_value(q) * phi.get_normal_vector(q)), q);
+
+		phi_p.integrate(true, false);
+		phi_p.distribute_local_to_global(dst);
+	}//face
+}
+
+template class pfem2MatrixFreeOperator<1>;
+template class pfem2MatrixFreeOperator<2>;
+
+template class pfem2MatrixFreeExplicitOperators<1>;
+template class pfem2MatrixFreeExplicitOperators<2>;
@@ -0,0 +1,162 @@
+#ifndef PFEM2MATRIXFREE_H
+#define PFEM2MATRIXFREE_H
+
+#include <map>
+#include <set>
+#include <vector>
+#include <memory>
+
+#include <deal.II/base/subscriptor.h>
+#include <deal.II/base/tensor.h>
+#include <deal.II/base/aligned_vector.h>
+#include <deal.II/base/vectorization.h>
+#include <deal.II/base/index_set.h>
+#include <deal.II/lac/vector.h>
+#include <deal.II/lac/block_vector.h>
+#include <deal.II/lac/diagonal_matrix.h>
+#include <deal.II/matrix_free/matrix_free.h>
+#include <deal.II/matrix_free/fe_evaluation.h>
+
+using namespace dealii;
+
+/*!
+ * \brief Оператор mass_factor * (N_i, N_j) + sum_d diffusion[d] * (dN_i/dx_d, dN_j/dx_d) без хранения матрицы
+ *
+ * Действие оператора вычисляется по ячейкам (MatrixFree/FEEvaluation: сумм-факторизация, векторизация по ячейкам).
+ * Используется вместо SparseMatrix<double> в решателях для компонент скорости и давления (mass_factor = 0, единичная диффузия - оператор Лапласа),
+ * а также как оператор уровня в многосеточном методе: vmult() учитывает ГУ, заданные apply_boundary_values() или set_zero_boundary_values()
+ * (строки и столбцы с ГУ исключаются, как в MatrixTools::apply_boundary_values(), диагональ в этих строках - 1),
+ * precondition_Jacobi() позволяет использовать PreconditionJacobi, get_matrix_diagonal_inverse() - PreconditionChebyshev.
+ */
+template <int fe_degree>
+class pfem2MatrixFreeOperator : public Subscriptor
+{
+public:
+	pfem2MatrixFreeOperator();
+
+	/*!
+	 * \brief Инициализация по данным matrix_free для DoFHandler'а с номером dof_index (для уровня сетки - по данным, построенным с level_mg_handler)
+	 */
+	void initialize(const std::shared_ptr<const MatrixFree<3,double>> &matrix_free, const unsigned int dof_index = 0);
+
+	/*!
+	 * \brief Задание коэффициентов оператора (диагональ вычисляется только для нового набора коэффициентов, ранее вычисленные хранятся)
+	 */
+	void set_coefficients(const double mass_factor, const Tensor<1,3> &diffusion);
+
+	/*!
+	 * \brief Сброс ГУ (начало сборки новой системы)
+	 */
+	void reset_boundary_values();
+
+	/*!
+	 * \brief Исключение ГУ boundary_values из системы с правой частью rhs, аналог MatrixTools::apply_boundary_values()
+	 *
+	 * Может вызываться несколько раз для одной системы: значение в узле, уже имеющем ГУ, заменяется новым (как при последовательном исключении).
+	 */
+	void apply_boundary_values(const std::map<types::global_dof_index,double> &boundary_values, Vector<double> &solution, Vector<double> &rhs);
+
+	/*!
+	 * \brief Нулевые ГУ в узлах indices (оператор уровня в многосеточном методе)
+	 */
+	void set_zero_boundary_values(const IndexSet &indices);
+
+	void vmult(Vector<double> &dst, const Vector<double> &src) const;				//!< Действие оператора с учетом ГУ
+	void vmult_add(Vector<double> &dst, const Vector<double> &src) const;
+	void Tvmult(Vector<double> &dst, const Vector<double> &src) const;				//!< Оператор симметричен: Tvmult() совпадает с vmult()
+	void Tvmult_add(Vector<double> &dst, const Vector<double> &src) const;
+	void apply(Vector<double> &dst, const Vector<double> &src) const;				//!< Действие оператора без учета ГУ
+	void apply_mass(Vector<double> &dst, const Vector<double> &src) const;			//!< Действие матрицы масс (N_i, N_j)
+	void precondition_Jacobi(Vector<double> &dst, const Vector<double> &src, const double omega = 1.0) const;
+
+	std::shared_ptr<DiagonalMatrix<Vector<double>>> get_matrix_diagonal_inverse() const;	//!< Обратная диагональ с учетом ГУ (предобусловливатель для PreconditionChebyshev)
+
+	unsigned int m() const;
+	unsigned int n() const;
+
+private:
+	typedef FEEvaluation<3, fe_degree, fe_degree + 1, 1, double> CellEvaluation;
+
+	void evaluate_cell(CellEvaluation &phi, const double cell_mass_factor, const bool with_diffusion) const;
+
+	void local_apply(const MatrixFree<3,double> &data, Vector<double> &dst, const Vector<double> &src, const std::pair<unsigned int,unsigned int> &cell_range) const;
+	void local_apply_mass(const MatrixFree<3,double> &data, Vector<double> &dst, const Vector<double> &src, const std::pair<unsigned int,unsigned int> &cell_range) const;
+	void local_compute_diagonal(const MatrixFree<3,double> &data, Vector<double> &dst, const unsigned int &dummy, const std::pair<unsigned int,unsigned int> &cell_range) const;
+
+	void update_inverse_diagonal();
+
+	/*!
+	 * \brief Обратная диагональ оператора без учета ГУ для одного набора коэффициентов
+	 */
+	struct CoefficientsDiagonal
+	{
+		double mass_factor;
+		Tensor<1,3> diffusion;
+		Vector<double> inverse_diagonal;
+	};
+
+	std::shared_ptr<const MatrixFree<3,double>> matrix_free;
+	unsigned int dof_index;
+
+	double mass_factor;
+	Tensor<1,3> diffusion;
+	bool has_diffusion;
+
+	std::vector<CoefficientsDiagonal> cached_diagonals;	//!< Обратные диагонали для встречавшихся наборов коэффициентов
+	unsigned int current_diagonal;			//!< Номер набора текущих коэффициентов в cached_diagonals
+	Vector<double> inverse_diagonal;		//!< Обратная диагональ с учетом ГУ (для PreconditionJacobi)
+
+	std::map<types::global_dof_index,double> constrained_values;	//!< ГУ текущей системы
+	Vector<double> boundary_lifting;		//!< Вклад исключенных столбцов с ГУ в правую часть (apply_boundary_values())
+	mutable Vector<double> src_free;		//!< Вектор-аргумент с обнуленными значениями в узлах с ГУ
+	mutable Vector<double> dst_add;			//!< Промежуточный результат для vmult_add()
+};
+
+/*!
+ * \brief Явные части уравнений для скорости и давления без хранения матриц
+ *
+ * Вычисляются обходом ячеек и граничных граней (MatrixFree::loop(), FEEvaluation/FEFaceEvaluation) по данным,
+ * построенным для двух DoFHandler'ов: 0 - компонента скорости (все компоненты используют один DoFHandler), 1 - давление.
+ * Компоненты скорости передаются блоками BlockVector. Заменяет матрицы явной части tau_ij (вместе с потоком через границы),
+ * градиента давления и дивергенции (с потоком скорости через границы).
+ */
+template <int fe_degree>
+class pfem2MatrixFreeExplicitOperators : public Subscriptor
+{
+public:
+	/*!
+	 * \brief Инициализация
+	 * \param matrix_free данные MatrixFree (mapping_update_flags_boundary_faces должны включать значения, градиенты и нормали)
+	 * \param stress_flux_boundaries границы с потоком tau_ij для каждой компоненты скорости
+	 * \param velocity_flux_boundaries границы с потоком скорости в уравнении для давления
+	 */
+	void initialize(const std::shared_ptr<const MatrixFree<3,double>> &matrix_free, const std::set<types::boundary_id> stress_flux_boundaries[3],
+		const std::set<types::boundary_id> &velocity_flux_boundaries);
+
+	void apply_viscous_coupling(BlockVector<double> &dst, const BlockVector<double> &velocity) const;		//!< Явная часть tau_ij (с потоком через границы)
+	void apply_pressure_gradient(BlockVector<double> &dst, const Vector<double> &pressure) const;			//!< (N_i, dP/dx_a)
+	void apply_divergence(Vector<double> &dst, const BlockVector<double> &velocity) const;					//!< (grad N_i, V) - поток V через границы
+
+private:
+	typedef FEEvaluation<3, fe_degree, fe_degree + 1, 3, double> VelocityEvaluation;
+	typedef FEEvaluation<3, fe_degree, fe_degree + 1, 1, double> PressureEvaluation;
+	typedef FEFaceEvaluation<3, fe_degree, fe_degree + 1, 3, double> VelocityFaceEvaluation;
+	typedef FEFaceEvaluation<3, fe_degree, fe_degree + 1, 1, double> PressureFaceEvaluation;
+
+	void local_viscous_coupling(const MatrixFree<3,double> &data, BlockVector<double> &dst, const BlockVector<double> &src, const std::pair<unsigned int,unsigned int> &cell_range) const;
+	void local_viscous_coupling_boundary(const MatrixFree<3,double> &data, BlockVector<double> &dst, const BlockVector<double> &src, const std::pair<unsigned int,unsigned int> &face_range) const;
+	void local_pressure_gradient(const MatrixFree<3,double> &data, BlockVector<double> &dst, const Vector<double> &src, const std::pair<unsigned int,unsigned int> &cell_range) const;
+	void local_divergence(const MatrixFree<3,double> &data, Vector<double> &dst, const BlockVector<double> &src, const std::pair<unsigned int,unsigned int> &cell_range) const;
+	void local_divergence_boundary(const MatrixFree<3,double> &data, Vector<double> &dst, const BlockVector<double> &src, const std::pair<unsigned int,unsigned int> &face_range) const;
+
+	//внутренние грани не дают вклада
+	template <typename OutVector, typename InVector>
+	void local_no_inner_faces(const MatrixFree<3,double> &, OutVector &, const InVector &, const std::pair<unsigned int,unsigned int> &) const {}
+
+	std::shared_ptr<const MatrixFree<3,double>> matrix_free;
+
+	std::set<types::boundary_id> stress_flux_boundaries[3];
+	std::set<types::boundary_id> velocity_flux_boundaries;
+};
+
+#endif // PFEM2MATRIXFREE_H
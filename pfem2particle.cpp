@@ -2,6 +2,8 @@
 
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <utility>
 
 #include <deal.II/base/std_cxx14/memory.h>
 
@@ -30,16 +32,92 @@
 #include <deal.II/grid/tria_accessor.h>
 
 #include <deal.II/lac/precondition.h>
-#include <deal.II/lac/solver_gmres.h>
 
 #include "omp.h"
 
+template <typename Number>
+void compute_shape_weights(const Point<3> &reference_location, std::array<Number, GeometryInfo<3>::vertices_per_cell> &weights)
+{
+	const double x = reference_location[0], y = reference_location[1], z = reference_location[2];
+	
+	//вершина v соответствует точке (v&1, (v>>1)&1, (v>>2)&1) единичной ячейки
+	const double xy00 = (1.0 - x) * (1.0 - y), xy10 = x * (1.0 - y), xy01 = (1.0 - x) * y, xy11 = x * y;
+	
+	weights[0] = xy00 * (1.0 - z);
+	weights[1] = xy10 * (1.0 - z);
+	weights[2] = xy01 * (1.0 - z);
+	weights[3] = xy11 * (1.0 - z);
+	weights[4] = xy00 * z;
+	weights[5] = xy10 * z;
+	weights[6] = xy01 * z;
+	weights[7] = xy11 * z;
+}
+
+template void compute_shape_weights<double>(const Point<3> &, std::array<double, GeometryInfo<3>::vertices_per_cell> &);
+template void compute_shape_weights<float>(const Point<3> &, std::array<float, GeometryInfo<3>::vertices_per_cell> &);
+
+//преобразования между double и типом хранения данных частиц
+template <typename Number>
+static inline Point<3> to_double_point(const Point<3,Number> &p)
+{
+	return Point<3>(p[0], p[1], p[2]);
+}
+
+//веса начального положения стадий методов Рунге-Кутты порядка 1-3 в форме Шу-Ошера (первая стадия - шаг Эйлера)
+static const double rk_start_weights[3][3] = { {0.0, 0.0, 0.0}, {0.0, 0.5, 0.0}, {0.0, 0.75, 1.0 / 3.0} };
+
+static inline Point<3,pfem2ParticleNumber> to_particle_point(const Point<3> &p)
+{
+	return Point<3,pfem2ParticleNumber>(p[0], p[1], p[2]);
+}
+
+std::uint64_t hilbert_curve_index(const Point<3> &p, const Point<3> &lower_corner, const Tensor<1,3> &extent)
+{
+	const unsigned int bits = 21;
+	const unsigned int max_coordinate = (1u << bits) - 1;
+	
+	unsigned int X[3];
+	for(unsigned int d = 0; d < 3; ++d){
+		const double t = extent[d] > 0.0 ? (p[d] - lower_corner[d]) / extent[d] : 0.0;
+		X[d] = static_cast<unsigned int>(std::min(std::max(t, 0.0), 1.0) * max_coordinate);
+	}
+	
+	//преобразование координат в "транспонированный" номер Гильберта (алгоритм J. Skilling, 2004)
+	for(unsigned int Q = 1u << (bits - 1); Q > 1; Q >>= 1){
+		const unsigned int P = Q - 1;
+		for(unsigned int i = 0; i < 3; ++i)
+			if(X[i] & Q) X[0] ^= P;
+			else {
+				const unsigned int t = (X[0] ^ X[i]) & P;
+				X[0] ^= t;
+				X[i] ^= t;
+			}
+	}
+	
+	for(unsigned int i = 1; i < 3; ++i) X[i] ^= X[i-1];
+	
+	unsigned int t = 0;
+	for(unsigned int Q = 1u << (bits - 1); Q > 1; Q >>= 1)
+		if(X[2] & Q) t ^= Q - 1;
+	
+	for(unsigned int i = 0; i < 3; ++i) X[i] ^= t;
+	
+	//чередование битов координат, начиная со старших
+	std::uint64_t index = 0;
+	for(int b = bits - 1; b >= 0; --b)
+		for(unsigned int i = 0; i < 3; ++i) index = (index << 1) | ((X[i] >> b) & 1u);
+	
+	return index;
+}
+
 pfem2Particle::pfem2Particle(const Point<3> & location,const Point<3> & reference_location,const unsigned id)
 	: location (location),
     reference_location (reference_location),
     id (id),
 	velocity({0.0,0.0,0.0}),
-	salinity(0.0)
+	velocity_ext({0.0,0.0,0.0}),
+	salinity(0.0),
+	mass(1.0)
 {
 
 }
@@ -64,14 +142,14 @@ const Point<3> & pfem2Particle::get_reference_location () const
     return reference_location;
 }
 
-unsigned int pfem2Particle::get_id () const
+void pfem2Particle::set_id (const unsigned int new_id)
 {
-    return id;
+	id = new_id;
 }
 
-void pfem2Particle::set_tria_position(const int &new_position)
+unsigned int pfem2Particle::get_id () const
 {
-	tria_position = new_position;
+    return id;
 }
 
 const Tensor<1,3> & pfem2Particle::get_velocity() const
@@ -103,6 +181,16 @@ void pfem2Particle::set_salinity (const double &new_salinity)
     salinity = new_salinity;
 }
 
+const double & pfem2Particle::get_mass() const
+{
+	return mass;
+}
+
+void pfem2Particle::set_mass (const double &new_mass)
+{
+	mass = new_mass;
+}
+
 void pfem2Particle::set_velocity_component (const double value, int component)
 {
 	velocity[component] = value;
@@ -113,486 +201,1290 @@ void pfem2Particle::set_velocity_ext (const Tensor<1,3> &new_ext_velocity)
 	velocity_ext = new_ext_velocity;
 }
 
-void pfem2Particle::set_map_position (const std::unordered_multimap<int, pfem2Particle*>::iterator &new_position)
+void pfem2CellGeometry::reinit(const typename Triangulation<3>::active_cell_iterator &cell)
 {
-	map_position = new_position;
+	//вершины ячейки нумеруются лексикографически: вершина v соответствует точке (v&1, (v>>1)&1, (v>>2)&1) единичной ячейки
+	coefficients[0] = cell->vertex(0);
+	coefficients[1] = cell->vertex(1) - cell->vertex(0);
+	coefficients[2] = cell->vertex(2) - cell->vertex(0);
+	coefficients[3] = cell->vertex(4) - cell->vertex(0);
+	coefficients[4] = cell->vertex(3) - cell->vertex(2) - cell->vertex(1) + cell->vertex(0);
+	coefficients[5] = cell->vertex(5) - cell->vertex(4) - cell->vertex(1) + cell->vertex(0);
+	coefficients[6] = cell->vertex(6) - cell->vertex(4) - cell->vertex(2) + cell->vertex(0);
+	coefficients[7] = cell->vertex(7) - cell->vertex(6) - cell->vertex(5) + cell->vertex(4)
+					  - cell->vertex(3) + cell->vertex(2) + cell->vertex(1) - cell->vertex(0);
+	
+	const double size = coefficients[1].norm() + coefficients[2].norm() + coefficients[3].norm();
+	const double distortion = coefficients[4].norm() + coefficients[5].norm() + coefficients[6].norm() + coefficients[7].norm();
+	
+	tolerance = 1e-12 * size;
+	incremental_tolerance = INCREMENTAL_RELOCATION_TOLERANCE * size;
+	affine = (distortion <= 1e-12 * size);
+	
+	Tensor<2,3> jacobian;
+	for (unsigned int i = 0; i < 3; ++i){
+		jacobian[i][0] = coefficients[1][i] + 0.5 * coefficients[4][i] + 0.5 * coefficients[5][i] + 0.25 * coefficients[7][i];
+		jacobian[i][1] = coefficients[2][i] + 0.5 * coefficients[4][i] + 0.5 * coefficients[6][i] + 0.25 * coefficients[7][i];
+		jacobian[i][2] = coefficients[3][i] + 0.5 * coefficients[5][i] + 0.5 * coefficients[6][i] + 0.25 * coefficients[7][i];
+	}
+	
+	center = transform_unit_to_real_cell(Point<3>(0.5, 0.5, 0.5));
+	inverse_jacobian = invert(jacobian);
 }
 
-const std::unordered_multimap<int, pfem2Particle*>::iterator & pfem2Particle::get_map_position () const
+Point<3> pfem2CellGeometry::transform_unit_to_real_cell(const Point<3> &p_unit) const
 {
-	return map_position;
+	const double u = p_unit[0], v = p_unit[1], w = p_unit[2];
+	
+	Point<3> p = coefficients[0];
+	for (unsigned int i = 0; i < 3; ++i)
+		p[i] += coefficients[1][i] * u + coefficients[2][i] * v + coefficients[3][i] * w
+				+ coefficients[4][i] * u * v + coefficients[5][i] * u * w + coefficients[6][i] * v * w + coefficients[7][i] * u * v * w;
+	
+	return p;
 }
 
-Triangulation<3>::cell_iterator pfem2Particle::get_surrounding_cell(const Triangulation<3> &triangulation) const
+pfem2PointLocation pfem2CellGeometry::transform_real_to_unit_cell(const Point<3> &p, Point<3> &p_unit) const
 {
-	const typename Triangulation<3>::cell_iterator cell(&triangulation, triangulation.n_levels() - 1, tria_position);
+	//начальное приближение (для аффинной ячейки - точное решение) по матрице Якоби в центре ячейки
+	p_unit = Point<3>(0.5, 0.5, 0.5) + inverse_jacobian * (p - center);
 	
-	return cell;
+	if(affine) return GeometryInfo<3>::is_inside_unit_cell(p_unit) ? point_inside_cell : point_outside_cell;
+	
+	const unsigned int max_iterations = 20;
+	const double min_determinant = 1e-12 * std::fabs(1.0 / determinant(inverse_jacobian));
+	bool converged = false;
+	
+	for (unsigned int iteration = 0; iteration < max_iterations; ++iteration){
+		const Tensor<1,3> residual = transform_unit_to_real_cell(p_unit) - p;
+		if(residual.norm() <= tolerance){
+			converged = true;
+			break;
+		}
+		
+		const Tensor<2,3> local_jacobian = jacobian(p_unit);
+		if(!(std::fabs(determinant(local_jacobian)) > min_determinant)) break;
+		
+		p_unit -= invert(local_jacobian) * residual;
+	}
+	
+	if(!converged){
+		p_unit = Point<3>(0.5, 0.5, 0.5) + inverse_jacobian * (p - center);
+		return point_transformation_failed;
+	}
+	
+	return GeometryInfo<3>::is_inside_unit_cell(p_unit) ? point_inside_cell : point_outside_cell;
 }
 
-unsigned int pfem2Particle::find_closest_vertex_of_cell(const typename Triangulation<3>::active_cell_iterator &cell, const Mapping<3> &mapping)
+Tensor<2,3> pfem2CellGeometry::jacobian(const Point<3> &p_unit) const
 {
-	//transformation of local particle coordinates transformation is required as the global particle coordinates have already been updated by the time this function is called
-	const Point<3> old_position = mapping.transform_unit_to_real_cell(cell, reference_location);
+	const double u = p_unit[0], v = p_unit[1], w = p_unit[2];
 	
-	Tensor<1,3> velocity_normalized = velocity_ext / velocity_ext.norm();
-	Tensor<1,3> particle_to_vertex = cell->vertex(0) - old_position;
-    particle_to_vertex /= particle_to_vertex.norm();
-    
-    double maximum_angle = velocity_normalized * particle_to_vertex;
-    unsigned int closest_vertex = 0;
-    
-    for (unsigned int v = 1; v < GeometryInfo<3>::vertices_per_cell; ++v){
-		particle_to_vertex = cell->vertex(v) - old_position;
-		particle_to_vertex /= particle_to_vertex.norm();
-		const double v_angle = velocity_normalized * particle_to_vertex;
-		
-		if (v_angle > maximum_angle){
-			closest_vertex = v;
-			maximum_angle = v_angle;
-		}
+	Tensor<2,3> result;
+	for (unsigned int i = 0; i < 3; ++i){
+		result[i][0] = coefficients[1][i] + coefficients[4][i] * v + coefficients[5][i] * w + coefficients[7][i] * v * w;
+		result[i][1] = coefficients[2][i] + coefficients[4][i] * u + coefficients[6][i] * w + coefficients[7][i] * u * w;
+		result[i][2] = coefficients[3][i] + coefficients[5][i] * u + coefficients[6][i] * v + coefficients[7][i] * u * v;
 	}
 	
-	return closest_vertex;
+	return result;
 }
 
-pfem2ParticleHandler::pfem2ParticleHandler(const parallel::distributed::Triangulation<3> &tria, const Mapping<3> &coordMapping)
-	: triangulation(&tria, typeid(*this).name())
-	, mapping(&coordMapping, typeid(*this).name())
-	, particles()
-	, global_number_of_particles(0)
-    , global_max_particles_per_cell(0)
-    {}
-    
-pfem2ParticleHandler::~pfem2ParticleHandler()
+bool pfem2CellGeometry::update_unit_point(const Point<3> &p, const Point<3> &p_unit_old, Point<3> &p_unit) const
 {
-	clear_particles();
+	if(affine) p_unit = Point<3>(0.5, 0.5, 0.5) + inverse_jacobian * (p - center);
+	else {
+		const Tensor<2,3> local_jacobian = jacobian(p_unit_old);
+		if(!(std::fabs(determinant(local_jacobian)) > 1e-12 * std::fabs(1.0 / determinant(inverse_jacobian)))) return false;
+		
+		//смещение вычисляется по фактическому положению точки (а не по velocity_ext), поэтому учитывает округление координат частиц
+		p_unit = p_unit_old + invert(local_jacobian) * (p - transform_unit_to_real_cell(p_unit_old));
+	}
+	
+	for (unsigned int d = 0; d < 3; ++d)
+		if(p_unit[d] < INCREMENTAL_RELOCATION_MARGIN || p_unit[d] > 1.0 - INCREMENTAL_RELOCATION_MARGIN) return false;
+	
+	//невязка проверяется по фактическому положению точки, поэтому погрешность линеаризации не накапливается от шага к шагу
+	return affine || (transform_unit_to_real_cell(p_unit) - p).norm() <= incremental_tolerance;
 }
 
-void pfem2ParticleHandler::initialize_maps()
+void pfem2CellSearchGrid::reinit(const Triangulation<3> &triangulation)
 {
-	vertex_to_cells = std::vector<std::set<typename Triangulation<3>::active_cell_iterator>>(GridTools::vertex_to_cell_map(*triangulation));
-    vertex_to_cell_centers = std::vector<std::vector<Tensor<1,3>>>(GridTools::vertex_to_cell_centers_directions(*triangulation,vertex_to_cells));	  
+	const unsigned int n_cells = triangulation.n_cells(triangulation.n_levels()-1);
+	
+	std::vector<Point<3>> cell_lower(n_cells), cell_upper(n_cells);
+	Point<3> upper_corner;
+	
+	bool first = true;
+	for(auto cell = triangulation.begin_active(); cell != triangulation.end(); ++cell){
+		Point<3> &lower = cell_lower[cell->index()];
+		Point<3> &upper = cell_upper[cell->index()];
+		
+		lower = upper = cell->vertex(0);
+		for (unsigned int v = 1; v < GeometryInfo<3>::vertices_per_cell; ++v)
+			for (unsigned int d = 0; d < 3; ++d){
+				lower[d] = std::min(lower[d], cell->vertex(v)[d]);
+				upper[d] = std::max(upper[d], cell->vertex(v)[d]);
+			}
+		
+		if(first){
+			lower_corner = lower;
+			upper_corner = upper;
+			first = false;
+		} else for (unsigned int d = 0; d < 3; ++d){
+			lower_corner[d] = std::min(lower_corner[d], lower[d]);
+			upper_corner[d] = std::max(upper_corner[d], upper[d]);
+		}
+	}
+	
+	//размер корзины выбирается так, чтобы на корзину приходилось порядка одной ячейки
+	const Tensor<1,3> extent = upper_corner - lower_corner;
+	const double h = std::cbrt(extent[0] * extent[1] * extent[2] / std::max(n_cells, 1u));
+	
+	for (unsigned int d = 0; d < 3; ++d){
+		n_bins[d] = (h > 0.0) ? std::max(1u, static_cast<unsigned int>(std::ceil(extent[d] / h))) : 1;
+		bin_size[d] = (extent[d] > 0.0) ? extent[d] / n_bins[d] : 1.0;
+	}
+	
+	//два прохода: подсчет числа ячеек в каждой корзине, затем заполнение
+	bin_offsets.assign(n_bins[0] * n_bins[1] * n_bins[2] + 1, 0);
+	
+	for (unsigned int pass = 0; pass < 2; ++pass){
+		std::vector<unsigned int> next_position;
+		if(pass == 1){
+			for (unsigned int bin = 0; bin + 1 < bin_offsets.size(); ++bin) bin_offsets[bin + 1] += bin_offsets[bin];
+			bin_cells.resize(bin_offsets.back());
+			next_position.assign(bin_offsets.begin(), bin_offsets.end() - 1);
+		}
+		
+		for (unsigned int cell = 0; cell < n_cells; ++cell){
+			unsigned int first_bin[3], last_bin[3];
+			for (unsigned int d = 0; d < 3; ++d){
+				first_bin[d] = std::min(n_bins[d] - 1, static_cast<unsigned int>(std::max(0.0, std::floor((cell_lower[cell][d] - lower_corner[d]) / bin_size[d]))));
+				last_bin[d] = std::min(n_bins[d] - 1, static_cast<unsigned int>(std::max(0.0, std::floor((cell_upper[cell][d] - lower_corner[d]) / bin_size[d]))));
+			}
+			
+			for (unsigned int k = first_bin[2]; k <= last_bin[2]; ++k)
+				for (unsigned int j = first_bin[1]; j <= last_bin[1]; ++j)
+					for (unsigned int i = first_bin[0]; i <= last_bin[0]; ++i){
+						const unsigned int bin = (k * n_bins[1] + j) * n_bins[0] + i;
+						
+						if(pass == 0) ++bin_offsets[bin + 1];
+						else bin_cells[next_position[bin]++] = cell;
+					}
+		}
+	}
 }
 
-void pfem2ParticleHandler::clear()
+unsigned int pfem2CellSearchGrid::find_bin(const Point<3> &p) const
 {
-	clear_particles();
-	global_number_of_particles    = 0;
-    global_max_particles_per_cell = 0;
+	unsigned int bin_index[3];
+	
+	for (unsigned int d = 0; d < 3; ++d){
+		const double x = (p[d] - lower_corner[d]) / bin_size[d];
+		if(!(x >= 0.0 && x <= n_bins[d])) return numbers::invalid_unsigned_int;
+		
+		bin_index[d] = std::min(n_bins[d] - 1, static_cast<unsigned int>(x));
+	}
+	
+	return (bin_index[2] * n_bins[1] + bin_index[1]) * n_bins[0] + bin_index[0];
 }
 
-void pfem2ParticleHandler::clear_particles()
+unsigned int pfem2ParticleArrays::size() const
 {
-	for(auto particleIndex = particles.begin(); particleIndex != particles.end(); ++particleIndex) delete (*particleIndex).second;
-	particles.clear();
+	return cell_indices.size();
 }
 
-void pfem2ParticleHandler::remove_particle(const pfem2Particle *particle)
+void pfem2ParticleArrays::resize(const unsigned int n)
 {
-	particles.erase(particle->get_map_position());
-	delete particle;
+	for(unsigned int d = 0; d < 3; ++d){
+		locations[d].resize(n);
+		velocities[d].resize(n);
+		velocities_ext[d].resize(n);
+	}
+	for(unsigned int vertex = 0; vertex < GeometryInfo<3>::vertices_per_cell; ++vertex) shape_weights[vertex].resize(n);
+	reference_locations.resize(n);
+	salinities.resize(n);
+	masses.resize(n);
+	movement_steps.resize(n);
+	ids.resize(n);
+	cell_indices.resize(n);
 }
 
-void pfem2ParticleHandler::insert_particle(pfem2Particle *particle,
-										   const typename Triangulation<3>::active_cell_iterator &cell)
+void pfem2ParticleArrays::reserve(const unsigned int n)
 {
-	typename std::unordered_multimap<int, pfem2Particle*>::iterator it = particles.insert(std::make_pair(cell->index(), particle));
-	particle->set_map_position(it);
-	particle->set_tria_position(cell->index());
+	for(unsigned int d = 0; d < 3; ++d){
+		locations[d].reserve(n);
+		velocities[d].reserve(n);
+		velocities_ext[d].reserve(n);
+	}
+	for(unsigned int vertex = 0; vertex < GeometryInfo<3>::vertices_per_cell; ++vertex) shape_weights[vertex].reserve(n);
+	reference_locations.reserve(n);
+	salinities.reserve(n);
+	masses.reserve(n);
+	movement_steps.reserve(n);
+	ids.reserve(n);
+	cell_indices.reserve(n);
 }
 
-unsigned int pfem2ParticleHandler::n_global_particles() const
+void pfem2ParticleArrays::clear()
 {
-	return particles.size();
+	for(unsigned int d = 0; d < 3; ++d){
+		locations[d].clear();
+		velocities[d].clear();
+		velocities_ext[d].clear();
+	}
+	for(unsigned int vertex = 0; vertex < GeometryInfo<3>::vertices_per_cell; ++vertex) shape_weights[vertex].clear();
+	reference_locations.clear();
+	salinities.clear();
+	masses.clear();
+	movement_steps.clear();
+	ids.clear();
+	cell_indices.clear();
 }
 
-unsigned int pfem2ParticleHandler::n_global_max_particles_per_cell() const
+void pfem2ParticleArrays::swap(pfem2ParticleArrays &other)
 {
-	return global_max_particles_per_cell;
+	//обмен перемещением всей структуры: каждый массив (в том числе добавленный позже) обменивается без копирования данных
+	std::swap(*this, other);
 }
 
-unsigned int pfem2ParticleHandler::n_locally_owned_particles() const
+bool pfem2ParticleArrays::sizes_consistent() const
 {
-	return particles.size();
+	const unsigned int n = cell_indices.size();
+	
+	for(unsigned int d = 0; d < 3; ++d)
+		if(locations[d].size() != n || velocities[d].size() != n || velocities_ext[d].size() != n) return false;
+	for(unsigned int vertex = 0; vertex < GeometryInfo<3>::vertices_per_cell; ++vertex)
+		if(shape_weights[vertex].size() != n) return false;
+	
+	return reference_locations.size() == n && salinities.size() == n && masses.size() == n && movement_steps.size() == n && ids.size() == n;
 }
 
-unsigned int pfem2ParticleHandler::n_particles_in_cell(const typename Triangulation<3>::active_cell_iterator &cell) const
+void pfem2ParticleArrays::copy_particle(const unsigned int from, pfem2ParticleArrays &destination, const unsigned int to) const
 {
-	return particles.count(cell->index());
+	for(unsigned int d = 0; d < 3; ++d){
+		destination.locations[d][to] = locations[d][from];
+		destination.velocities[d][to] = velocities[d][from];
+		destination.velocities_ext[d][to] = velocities_ext[d][from];
+	}
+	for(unsigned int vertex = 0; vertex < GeometryInfo<3>::vertices_per_cell; ++vertex) destination.shape_weights[vertex][to] = shape_weights[vertex][from];
+	destination.reference_locations[to] = reference_locations[from];
+	destination.salinities[to] = salinities[from];
+	destination.masses[to] = masses[from];
+	destination.movement_steps[to] = movement_steps[from];
+	destination.ids[to] = ids[from];
+	destination.cell_indices[to] = cell_indices[from];
 }
 
-bool compare_particle_association(const unsigned int a, const unsigned int b, const Tensor<1,3> &particle_direction, const std::vector<Tensor<1,3> > &center_directions)
+Point<3> pfem2ParticleArrays::get_location(const unsigned int particle) const
 {
-	const double scalar_product_a = center_directions[a] * particle_direction;
-    const double scalar_product_b = center_directions[b] * particle_direction;
+	return Point<3>(locations[0][particle], locations[1][particle], locations[2][particle]);
+}
 
-    return scalar_product_a > scalar_product_b;
+void pfem2ParticleArrays::set_location(const unsigned int particle, const Point<3> &location)
+{
+	for(unsigned int d = 0; d < 3; ++d) locations[d][particle] = location[d];
 }
 
-void pfem2ParticleHandler::sort_particles_into_subdomains_and_cells()
+void pfem2ParticleArrays::set_reference_location(const unsigned int particle, const Point<3> &reference_location)
 {
-#ifdef VERBOSE_OUTPUT
-	std::cout << "Started sorting particles..." << std::endl;
-	double start = omp_get_wtime();
-#endif // VERBOSE_OUTPUT
+	reference_locations[particle] = to_particle_point(reference_location);
 	
-	std::vector<std::unordered_multimap<int, pfem2Particle*>::iterator> particles_out_of_cell;
-	particles_out_of_cell.reserve(particles.size());
-	
-	for(auto it = begin(); it != end(); ++it){
-		const typename Triangulation<3>::cell_iterator cell = (*it).second->get_surrounding_cell(*triangulation);
-		
-		try{
-			const Point<3> p_unit = mapping->transform_real_to_unit_cell(cell, (*it).second->get_location());
-		
-			if(GeometryInfo<3>::is_inside_unit_cell(p_unit)) (*it).second->set_reference_location(p_unit);
-			else particles_out_of_cell.push_back(it);
-		} catch(typename Mapping<3>::ExcTransformationFailed &){
-#ifdef VERBOSE_OUTPUT
-			std::cout << "Transformation failed for particle with global coordinates " << (*it).second->get_location() << " (checked cell index #" << cell->index() << ")" << std::endl;
-#endif // VERBOSE_OUTPUT
-			
-			particles_out_of_cell.push_back(it);
-		}
-	}
+	pfem2ParticleShapeWeights weights;
+	compute_shape_weights(reference_location, weights);
+	for(unsigned int vertex = 0; vertex < GeometryInfo<3>::vertices_per_cell; ++vertex) shape_weights[vertex][particle] = weights[vertex];
+}
 
-#ifdef VERBOSE_OUTPUT	
-	double checkingPositionsEnd = omp_get_wtime();
-	std::cout << "Finished sorting out gone particles" << std::endl;
-#endif // VERBOSE_OUTPUT
-	
-	std::vector<std::pair<int, pfem2Particle*>> sorted_particles;
-	std::vector<std::unordered_multimap<int, pfem2Particle*>::iterator> moved_particles, particles_to_be_deleted;
-	
-	typedef typename std::vector<std::pair<int, pfem2Particle*>>::size_type vector_size;
-	typedef typename std::vector<std::unordered_multimap<int, pfem2Particle*>::iterator>::size_type vector_size2;
+pfem2ParticleShapeWeights pfem2ParticleArrays::get_shape_weights(const unsigned int particle) const
+{
+	pfem2ParticleShapeWeights weights;
+	for(unsigned int vertex = 0; vertex < GeometryInfo<3>::vertices_per_cell; ++vertex) weights[vertex] = shape_weights[vertex][particle];
 	
-	sorted_particles.reserve(static_cast<vector_size> (particles_out_of_cell.size()*1.25));
-	moved_particles.reserve(static_cast<vector_size2> (particles_out_of_cell.size()*1.25));
-	particles_to_be_deleted.reserve(static_cast<vector_size2> (particles_out_of_cell.size()*1.25));
-
-#ifdef VERBOSE_OUTPUT
-	double prepareToSortClock;
-	double closestVertexClocks = 0;
-	double neighboursSortingClocks = 0;
-	double neighboursCheckClocks = 0;
-	double globalCellSearchClocks = 0;
-	double particleFinalizationClocks = 0;
-	
-	double catchClocks = 0;
-#endif // VERBOSE_OUTPUT
-			
-	{
-	  std::vector<unsigned int> neighbor_permutation;
+	return weights;
+}
 
-#ifdef VERBOSE_OUTPUT
-	  std::cout << "Finished building vertex to cell and cell centers map" << std::endl;
-	  prepareToSortClock = omp_get_wtime();
-	  int numOutOfMesh = 0;
-#endif // VERBOSE_OUTPUT
+Tensor<1,3> pfem2ParticleArrays::get_velocity(const unsigned int particle) const
+{
+	Tensor<1,3> result;
+	for(unsigned int d = 0; d < 3; ++d) result[d] = velocities[d][particle];
+	
+	return result;
+}
 
-      for (auto it = particles_out_of_cell.begin(); it != particles_out_of_cell.end(); ++it){
-#ifdef VERBOSE_OUTPUT
-      	  double particleStart = omp_get_wtime();
-#endif // VERBOSE_OUTPUT
-		  
-		  Point<3> current_reference_position;
-          bool found_cell = false;
+void pfem2ParticleArrays::set_velocity(const unsigned int particle, const Tensor<1,3> &velocity)
+{
+	for(unsigned int d = 0; d < 3; ++d) velocities[d][particle] = velocity[d];
+}
 
-		  auto particle = (*it);
+Tensor<1,3> pfem2ParticleArrays::get_velocity_ext(const unsigned int particle) const
+{
+	Tensor<1,3> result;
+	for(unsigned int d = 0; d < 3; ++d) result[d] = velocities_ext[d][particle];
+	
+	return result;
+}
 
-          typename Triangulation<3>::active_cell_iterator current_cell = (*particle).second->get_surrounding_cell(*triangulation);
+void pfem2ParticleArrays::set_velocity_ext(const unsigned int particle, const Tensor<1,3> &velocity_ext)
+{
+	for(unsigned int d = 0; d < 3; ++d) velocities_ext[d][particle] = velocity_ext[d];
+}
 
-          const unsigned int closest_vertex = (*particle).second->find_closest_vertex_of_cell(current_cell, *mapping);
-          Tensor<1,3> vertex_to_particle = (*particle).second->get_location() - current_cell->vertex(closest_vertex);
-          vertex_to_particle /= vertex_to_particle.norm();
+pfem2ParticleHandler::pfem2ParticleHandler(const parallel::distributed::Triangulation<3> &tria, const Mapping<3> &coordMapping)
+	: triangulation(&tria, typeid(*this).name())
+	, mapping(&coordMapping, typeid(*this).name())
+	, last_sort_relocated(0)
+	, last_sort_deleted(0)
+	, last_sort_incremental(0)
+	, buckets_outdated(false)
+	, global_number_of_particles(0)
+    , global_max_particles_per_cell(0)
+    {}
+    
+pfem2ParticleHandler::~pfem2ParticleHandler()
+{
+	clear_particles();
+}
 
-#ifdef VERBOSE_OUTPUT
-		  double closestVertexEnd = omp_get_wtime();
-		  closestVertexClocks += closestVertexEnd - particleStart;
-#endif // VERBOSE_OUTPUT
+void pfem2ParticleHandler::initialize_maps()
+{
+	//два прохода по ячейкам: подсчет числа ячеек у каждой вершины, затем заполнение (ячейки вершины упорядочены по номерам)
+	vertex_to_cell_offsets.assign(triangulation->n_vertices() + 1, 0);
+	for(auto cell = triangulation->begin_active(); cell != triangulation->end(); ++cell)
+		for (unsigned int v = 0; v < GeometryInfo<3>::vertices_per_cell; ++v) ++vertex_to_cell_offsets[cell->vertex_index(v) + 1];
+	
+	for (unsigned int vertex = 0; vertex < triangulation->n_vertices(); ++vertex) vertex_to_cell_offsets[vertex + 1] += vertex_to_cell_offsets[vertex];
+	
+	vertex_to_cell_indices.resize(vertex_to_cell_offsets.back());
+	vertex_to_cell_vertex_numbers.resize(vertex_to_cell_offsets.back());
+	
+	std::vector<unsigned int> vertex_position(vertex_to_cell_offsets.begin(), vertex_to_cell_offsets.end() - 1);
+	for(auto cell = triangulation->begin_active(); cell != triangulation->end(); ++cell)
+		for (unsigned int v = 0; v < GeometryInfo<3>::vertices_per_cell; ++v){
+			const unsigned int k = vertex_position[cell->vertex_index(v)]++;
+			
+			vertex_to_cell_indices[k] = cell->index();
+			vertex_to_cell_vertex_numbers[k] = v;
+		}
+    
+    cell_geometries.resize(triangulation->n_cells(triangulation->n_levels()-1));
+    for(auto cell = triangulation->begin_active(); cell != triangulation->end(); ++cell) cell_geometries[cell->index()].reinit(cell);
+    
+    cell_search_grid.reinit(*triangulation);
+}
 
-          const unsigned int closest_vertex_index = current_cell->vertex_index(closest_vertex);
-          const unsigned int n_neighbor_cells = vertex_to_cells[closest_vertex_index].size();
+pfem2PointLocation pfem2ParticleHandler::locate_point_in_cell(const int cell_index, const Point<3> &p, Point<3> &p_unit) const
+{
+	return cell_geometries[cell_index].transform_real_to_unit_cell(p, p_unit);
+}
 
-		  neighbor_permutation.resize(n_neighbor_cells);
-		  
-          for (unsigned int i=0; i<n_neighbor_cells; ++i) neighbor_permutation[i] = i;
+void pfem2ParticleHandler::clear()
+{
+	clear_particles();
+	global_number_of_particles    = 0;
+    global_max_particles_per_cell = 0;
+}
 
-          std::sort(neighbor_permutation.begin(), neighbor_permutation.end(),
-			std::bind(&compare_particle_association, std::placeholders::_1, std::placeholders::_2, std::cref(vertex_to_particle), std::cref(vertex_to_cell_centers[closest_vertex_index])));
+void pfem2ParticleHandler::clear_particles()
+{
+	particles.clear();
+	spare_particles.clear();
+	free_slots.clear();
+	cell_offsets.clear();
+	
+	buckets_outdated = false;
+	global_number_of_particles = 0;
+}
 
-#ifdef VERBOSE_OUTPUT
-		  double neighboursSortingEnd = omp_get_wtime();
-		  neighboursSortingClocks += neighboursSortingEnd - closestVertexEnd;
-#endif // VERBOSE_OUTPUT
-			
-		  for (unsigned int i=0; i<n_neighbor_cells; ++i){
-		      typename std::set<typename Triangulation<3>::active_cell_iterator>::const_iterator cell = vertex_to_cells[closest_vertex_index].begin();
-
-              std::advance(cell,neighbor_permutation[i]);
-              
-              try{
-				  const Point<3> p_unit = mapping->transform_real_to_unit_cell(*cell, (*particle).second->get_location());
-				  if (GeometryInfo<3>::is_inside_unit_cell(p_unit)){
-					current_cell = *cell;
-					current_reference_position = p_unit;
-					(*particle).second->set_tria_position(current_cell->index());
-					found_cell = true;
-					
-#ifdef VERBOSE_OUTPUT
-					//std::cout << "Particle found in a neighbour cell" << std::endl;
-#endif // VERBOSE_OUTPUT
-					
-					break; 
-				  }
-              } catch(typename Mapping<3>::ExcTransformationFailed &)
-                { }
-            }
+void pfem2ParticleHandler::remove_particle(const unsigned int particle)
+{
+	if(particles.cell_indices[particle] < 0) return;
+	
+	particles.cell_indices[particle] = -1;
+	free_slots.push_back(particle);
+	buckets_outdated = true;
+}
 
-#ifdef VERBOSE_OUTPUT
-          double neighboursCheckEnd = omp_get_wtime();
-          neighboursCheckClocks += neighboursCheckEnd - neighboursSortingEnd;
-          
-          double t1,t2;
-#endif // VERBOSE_OUTPUT
-          
-          if (!found_cell){			  
-#ifdef VERBOSE_OUTPUT
-              ++numOutOfMesh;
-#endif // VERBOSE_OUTPUT
-              
-              particles_to_be_deleted.push_back(particle);
-              continue;
-                      
-/*                      
-			  t1 = omp_get_wtime();          
-			  try {
-                  const std::pair<const typename Triangulation<2>::active_cell_iterator, Point<2> > current_cell_and_position =
-                          GridTools::find_active_cell_around_point<2> (*mapping, *triangulation, (*particle).second->get_location());
-              
-                  current_cell = current_cell_and_position.first;
-                  current_reference_position = current_cell_and_position.second;
-                  //std::cout << "Particle found in a far away cell" << std::endl;
-              } catch (GridTools::ExcPointNotFound<2> &){				  
-				  particles_to_be_deleted.push_back(particle);
-				  //std::cout << "Particle not found" << std::endl;
-				  ++numOutOfMesh;
-				  t2 = omp_get_wtime();
-				  
-				  catchClocks += t2-t1;
-				  continue;
-			  }
-*/
-          }
-                    
-#ifdef VERBOSE_OUTPUT
-          double globalCellSearchEnd = omp_get_wtime();
-          globalCellSearchClocks += globalCellSearchEnd - neighboursCheckEnd;
-#endif // VERBOSE_OUTPUT
-          
-          (*particle).second->set_reference_location(current_reference_position);
-          sorted_particles.push_back(std::make_pair(current_cell->index(), (*particle).second));
-          moved_particles.push_back(particle);
-                   
-#ifdef VERBOSE_OUTPUT
-          double particleFinalizationEnd = omp_get_wtime();
-          particleFinalizationClocks += particleFinalizationEnd - globalCellSearchEnd;
-#endif // VERBOSE_OUTPUT
-	  }                                                        
-	  
-#ifdef VERBOSE_OUTPUT	  
-	  std::cout << "N out of mesh = " << numOutOfMesh << std::endl;
-#endif // VERBOSE_OUTPUT
+unsigned int pfem2ParticleHandler::insert_particle(const pfem2Particle &particle,
+												   const typename Triangulation<3>::active_cell_iterator &cell)
+{
+	unsigned int slot;
+	
+	//место удаленной частицы используется повторно, новое место выделяется только при пустом списке свободных
+	if(!free_slots.empty()){
+		slot = free_slots.back();
+		free_slots.pop_back();
+	} else {
+		slot = particles.size();
+		particles.resize(slot + 1);
 	}
 	
-#ifdef VERBOSE_OUTPUT	
-	std::cout << "Finished processing gone particles" << std::endl;
+	particles.set_location(slot, particle.get_location());
+	particles.set_reference_location(slot, particle.get_reference_location());
+	particles.set_velocity(slot, particle.get_velocity());
+	particles.set_velocity_ext(slot, particle.get_velocity_ext());
+	particles.salinities[slot] = particle.get_salinity();
+	particles.masses[slot] = particle.get_mass();
+	particles.movement_steps[slot] = 1;
+	particles.ids[slot] = particle.get_id();
+	particles.cell_indices[slot] = cell->index();
 	
-	double presortingStart = omp_get_wtime();
-#endif // VERBOSE_OUTPUT
+	buckets_outdated = true;
 	
-	std::unordered_multimap<int,pfem2Particle*> sorted_particles_map;
-	sorted_particles_map.insert(sorted_particles.begin(), sorted_particles.end());
+	return slot;
+}
+
+void pfem2ParticleHandler::reserve(const unsigned int n_particles)
+{
+	particles.reserve(n_particles);
+	spare_particles.reserve(n_particles);
+}
+
+void pfem2ParticleHandler::update_cell_buckets()
+{
+	const unsigned int n_cells = triangulation->n_cells(triangulation->n_levels()-1);
 	
-#ifdef VERBOSE_OUTPUT
-	double presortingEnd = omp_get_wtime();
-#endif // VERBOSE_OUTPUT
-		
-	for (unsigned int i=0; i<particles_to_be_deleted.size(); ++i){
-		auto particle = particles_to_be_deleted[i];
-		delete (*particle).second;
-		particles.erase(particle);
-	}
+	if(!buckets_outdated && cell_offsets.size() == n_cells + 1) return;
 	
-#ifdef VERBOSE_OUTPUT
-	double particlesDeleteClock = omp_get_wtime();
-#endif // VERBOSE_OUTPUT
+	//сортировка подсчетом: сначала количество частиц в каждой ячейке, затем смещения начала диапазонов ячеек
+	cell_offsets.assign(n_cells + 1, 0);
+	for(unsigned int i = 0; i < particles.size(); ++i)
+		if(particles.cell_indices[i] >= 0) ++cell_offsets[particles.cell_indices[i] + 1];
 	
-	for (unsigned int i=0; i<moved_particles.size(); ++i) particles.erase(moved_particles[i]);
-
-#ifdef VERBOSE_OUTPUT
-	double movedParticlesEraseClock = omp_get_wtime();
-#endif // VERBOSE_OUTPUT
+	global_max_particles_per_cell = 0;
+	for(unsigned int cell = 0; cell < n_cells; ++cell){
+		global_max_particles_per_cell = std::max(global_max_particles_per_cell, cell_offsets[cell + 1]);
+		cell_offsets[cell + 1] += cell_offsets[cell];
+	}
 	
-	particles.insert(sorted_particles_map.begin(),sorted_particles_map.end());
+	const unsigned int n_particles = cell_offsets[n_cells];
+	spare_particles.resize(n_particles);
 	
-#ifdef VERBOSE_OUTPUT
-	double end = omp_get_wtime();
+	//порядок частиц внутри ячейки сохраняется, поэтому результат не зависит от истории вставок
+	next_position.assign(cell_offsets.begin(), cell_offsets.end() - 1);
+	for(unsigned int i = 0; i < particles.size(); ++i)
+		if(particles.cell_indices[i] >= 0) particles.copy_particle(i, spare_particles, next_position[particles.cell_indices[i]]++);
 	
-	std::cout << "Checking positions time: " << (checkingPositionsEnd-start) << " sec. (" << (checkingPositionsEnd-start)/(end-start)*100 << "% of total)" << std::endl;
-	std::cout << "Preparation for sorting time: " << (prepareToSortClock-checkingPositionsEnd) << " sec. (" << (prepareToSortClock-checkingPositionsEnd)/(end-start)*100 << "% of total)" << std::endl;
+	particles.swap(spare_particles);
+	Assert(particles.sizes_consistent(), ExcInternalError());
+	free_slots.clear();
 	
-	std::cout << "Getting the closest vertex time: " << closestVertexClocks << " sec. (" << closestVertexClocks/(end-start)*100 << "% of total)" << std::endl;
-	std::cout << "Neighbours' sorting time: " << neighboursSortingClocks << " sec. (" << neighboursSortingClocks/(end-start)*100 << "% of total)" << std::endl;
-	std::cout << "Neighbours' checking time: " << neighboursCheckClocks << " sec. (" << neighboursCheckClocks/(end-start)*100 << "% of total)" << std::endl;
-	std::cout << "Global cell search time: " << globalCellSearchClocks << " sec. (" << globalCellSearchClocks/(end-start)*100 << "% of total)" << std::endl;
-	std::cout << "Exception catch time: " << catchClocks << " sec. (" << catchClocks/(end-start)*100 << "% of total)" << std::endl;
-	std::cout << "Finalization for particle time: " << particleFinalizationClocks << " sec. (" << particleFinalizationClocks/(end-start)*100 << "% of total)" << std::endl;
+	global_number_of_particles = n_particles;
+	buckets_outdated = false;
+}
 
-	std::cout << "Pre-sorting time: " << (presortingEnd-presortingStart) << " sec. (" << (presortingEnd-presortingStart)/(end-start)*100 << "% of total)" << std::endl;
-	std::cout << "Particles delete time: " << (particlesDeleteClock-presortingEnd) << " sec. (" << (particlesDeleteClock-presortingEnd)/(end-start)*100 << "% of total)" << std::endl;
-	std::cout << "Moved particles erase time: " << (movedParticlesEraseClock-particlesDeleteClock) << " sec. (" << (movedParticlesEraseClock-particlesDeleteClock)/(end-start)*100 << "% of total)" << std::endl;
-	std::cout << "Pre-sorted particles insert time: " << (end-movedParticlesEraseClock) << " sec. (" << (end-movedParticlesEraseClock)/(end-start)*100 << "% of total)" << std::endl;
-	std::cout << "Total sorting time: " << (end - start) << " sec." << std::endl;
-	
-	std::cout << "Finished sorting particles" << std::endl;
-#endif // VERBOSE_OUTPUT
+unsigned int pfem2ParticleHandler::n_global_particles() const
+{
+	return global_number_of_particles;
 }
 
-std::unordered_multimap<int, pfem2Particle*>::iterator pfem2ParticleHandler::begin()
+unsigned int pfem2ParticleHandler::n_global_max_particles_per_cell() const
 {
-	return particles.begin();
+	return global_max_particles_per_cell;
 }
 
-std::unordered_multimap<int, pfem2Particle*>::iterator pfem2ParticleHandler::end()
+unsigned int pfem2ParticleHandler::n_locally_owned_particles() const
 {
-	return particles.end();
+	return global_number_of_particles;
 }
 
-std::unordered_multimap<int, pfem2Particle*>::iterator pfem2ParticleHandler::particles_in_cell_begin(const typename Triangulation<3>::active_cell_iterator &cell)
+unsigned int pfem2ParticleHandler::n_particles_in_cell(const typename Triangulation<3>::active_cell_iterator &cell) const
 {
-	return particles.equal_range(cell->index()).first;
+	return cell_offsets[cell->index() + 1] - cell_offsets[cell->index()];
 }
 
-std::unordered_multimap<int, pfem2Particle*>::iterator pfem2ParticleHandler::particles_in_cell_end(const typename Triangulation<3>::active_cell_iterator &cell)
+Point<3> pfem2ParticleHandler::get_location (const unsigned int particle) const
 {
-	return particles.equal_range(cell->index()).second;
+	return particles.get_location(particle);
 }
 
-pfem2Solver::pfem2Solver()
-	: tria(MPI_COMM_WORLD,Triangulation<3>::maximum_smoothing),
-	particle_handler(tria, mapping),
-	feVx (1),
-	feVy (1),
-	feVz (1),
-	feP (1),
-	fe(FE_Q<3>(1), 1),
-	dof_handlerVx (tria),
-	dof_handlerVy (tria),
-	dof_handlerVz (tria),
-	dof_handlerP (tria),
-	quantities({0,0,0})
+void pfem2ParticleHandler::set_location (const unsigned int particle, const Point<3> &new_location)
 {
-	projection_func_count = (3 + PROJECTION_FUNCTIONS_DEGREE) * (2 + PROJECTION_FUNCTIONS_DEGREE) * (1 + PROJECTION_FUNCTIONS_DEGREE) / 6.0;
+	particles.set_location(particle, new_location);
 }
 
-pfem2Solver::~pfem2Solver()
+Point<3> pfem2ParticleHandler::get_reference_location (const unsigned int particle) const
 {
-	
+	return to_double_point(particles.reference_locations[particle]);
 }
 
-void pfem2Solver::seed_particles_into_cell (const typename DoFHandler<3>::cell_iterator &cell)
+void pfem2ParticleHandler::set_reference_location (const unsigned int particle, const Point<3> &new_reference_location)
+{
+	particles.set_reference_location(particle, new_reference_location);
+}
+
+pfem2ParticleShapeWeights pfem2ParticleHandler::get_shape_weights (const unsigned int particle) const
+{
+	return particles.get_shape_weights(particle);
+}
+
+unsigned int pfem2ParticleHandler::get_id (const unsigned int particle) const
+{
+	return particles.ids[particle];
+}
+
+Tensor<1,3> pfem2ParticleHandler::get_velocity (const unsigned int particle) const
+{
+	return particles.get_velocity(particle);
+}
+
+double pfem2ParticleHandler::get_velocity_component (const unsigned int particle, int component) const
+{
+	return particles.velocities[component][particle];
+}
+
+void pfem2ParticleHandler::set_velocity (const unsigned int particle, const Tensor<1,3> &new_velocity)
+{
+	particles.set_velocity(particle, new_velocity);
+}
+
+void pfem2ParticleHandler::set_velocity_component (const unsigned int particle, const double value, int component)
+{
+	particles.velocities[component][particle] = value;
+}
+
+Tensor<1,3> pfem2ParticleHandler::get_velocity_ext (const unsigned int particle) const
+{
+	return particles.get_velocity_ext(particle);
+}
+
+void pfem2ParticleHandler::set_velocity_ext (const unsigned int particle, const Tensor<1,3> &new_ext_velocity)
+{
+	particles.set_velocity_ext(particle, new_ext_velocity);
+}
+
+double pfem2ParticleHandler::get_salinity (const unsigned int particle) const
+{
+	return particles.salinities[particle];
+}
+
+void pfem2ParticleHandler::set_salinity (const unsigned int particle, const double &new_salinity)
+{
+	particles.salinities[particle] = new_salinity;
+}
+
+double pfem2ParticleHandler::get_mass (const unsigned int particle) const
+{
+	return particles.masses[particle];
+}
+
+void pfem2ParticleHandler::set_mass (const unsigned int particle, const double &new_mass)
+{
+	particles.masses[particle] = new_mass;
+}
+
+Triangulation<3>::active_cell_iterator pfem2ParticleHandler::get_surrounding_cell(const unsigned int particle) const
+{
+	const typename Triangulation<3>::active_cell_iterator cell(&(*triangulation), triangulation->n_levels() - 1, particles.cell_indices[particle]);
+	
+	return cell;
+}
+
+void pfem2ParticleHandler::add_interpolated_velocities(const typename Triangulation<3>::active_cell_iterator &cell, const pfem2CellNodeValues &node_values)
+{
+	const unsigned int beginIndex = cell_offsets[cell->index()], endIndex = cell_offsets[cell->index() + 1];
+	const pfem2ParticleNumber *shape_weights[GeometryInfo<3>::vertices_per_cell];
+	for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex) shape_weights[vertex] = particles.shape_weights[vertex].data();
+	pfem2ParticleNumber *velocity0 = particles.velocities[0].data(), *velocity1 = particles.velocities[1].data(), *velocity2 = particles.velocities[2].data();
+	
+#pragma omp simd
+	for(unsigned int particleIndex = beginIndex; particleIndex < endIndex; ++particleIndex){
+		double value0 = 0.0, value1 = 0.0, value2 = 0.0;
+		
+		for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex){
+			const double shapeValue = shape_weights[vertex][particleIndex];
+			value0 += shapeValue * node_values[0][vertex];
+			value1 += shapeValue * node_values[1][vertex];
+			value2 += shapeValue * node_values[2][vertex];
+		}//vertex
+		
+		velocity0[particleIndex] += value0;
+		velocity1[particleIndex] += value1;
+		velocity2[particleIndex] += value2;
+	}//particle
+}
+
+void pfem2ParticleHandler::advect_in_cell(const typename Triangulation<3>::active_cell_iterator &cell, const pfem2CellNodeValues &node_velocities, const double time_step, const unsigned int n_steps)
+{
+	const unsigned int beginIndex = cell_offsets[cell->index()], endIndex = cell_offsets[cell->index() + 1];
+	const double dt = time_step / n_steps;
+	
+	std::fill(particles.movement_steps.begin() + beginIndex, particles.movement_steps.begin() + endIndex, n_steps);
+	
+	const pfem2ParticleNumber *shape_weights[GeometryInfo<3>::vertices_per_cell];
+	for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex) shape_weights[vertex] = particles.shape_weights[vertex].data();
+	pfem2ParticleNumber *location0 = particles.locations[0].data(), *location1 = particles.locations[1].data(), *location2 = particles.locations[2].data();
+	pfem2ParticleNumber *velocity_ext0 = particles.velocities_ext[0].data(), *velocity_ext1 = particles.velocities_ext[1].data(), *velocity_ext2 = particles.velocities_ext[2].data();
+	
+#pragma omp simd
+	for(unsigned int particleIndex = beginIndex; particleIndex < endIndex; ++particleIndex){
+		double velocity0 = 0.0, velocity1 = 0.0, velocity2 = 0.0;
+		
+		for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex){
+			const double shapeValue = shape_weights[vertex][particleIndex];
+			velocity0 += shapeValue * node_velocities[0][vertex];
+			velocity1 += shapeValue * node_velocities[1][vertex];
+			velocity2 += shapeValue * node_velocities[2][vertex];
+		}//vertex
+		
+		velocity0 *= dt;
+		velocity1 *= dt;
+		velocity2 *= dt;
+		
+		location0[particleIndex] += velocity0;
+		location1[particleIndex] += velocity1;
+		location2[particleIndex] += velocity2;
+		
+		velocity_ext0[particleIndex] = velocity0;
+		velocity_ext1[particleIndex] = velocity1;
+		velocity_ext2[particleIndex] = velocity2;
+	}//particle
+}
+
+void pfem2ParticleHandler::advect_stage_in_cell(const typename Triangulation<3>::active_cell_iterator &cell, const pfem2CellNodeValues &node_velocities, const double time_step, const double start_weight)
+{
+	const unsigned int beginIndex = cell_offsets[cell->index()], endIndex = cell_offsets[cell->index() + 1];
+	const pfem2ParticleNumber *shape_weights[GeometryInfo<3>::vertices_per_cell];
+	for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex) shape_weights[vertex] = particles.shape_weights[vertex].data();
+	pfem2ParticleNumber *location0 = particles.locations[0].data(), *location1 = particles.locations[1].data(), *location2 = particles.locations[2].data();
+	pfem2ParticleNumber *velocity_ext0 = particles.velocities_ext[0].data(), *velocity_ext1 = particles.velocities_ext[1].data(), *velocity_ext2 = particles.velocities_ext[2].data();
+	const unsigned int *movement_steps = particles.movement_steps.data();
+	const double stage_weight = 1.0 - start_weight;
+	
+#pragma omp simd
+	for(unsigned int particleIndex = beginIndex; particleIndex < endIndex; ++particleIndex){
+		double velocity0 = 0.0, velocity1 = 0.0, velocity2 = 0.0;
+		
+		for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex){
+			const double shapeValue = shape_weights[vertex][particleIndex];
+			velocity0 += shapeValue * node_velocities[0][vertex];
+			velocity1 += shapeValue * node_velocities[1][vertex];
+			velocity2 += shapeValue * node_velocities[2][vertex];
+		}//vertex
+		
+		const double displacement0 = velocity_ext0[particleIndex], displacement1 = velocity_ext1[particleIndex], displacement2 = velocity_ext2[particleIndex];
+		const double dt = time_step / movement_steps[particleIndex];
+		
+		velocity0 = stage_weight * (displacement0 + dt * velocity0);
+		velocity1 = stage_weight * (displacement1 + dt * velocity1);
+		velocity2 = stage_weight * (displacement2 + dt * velocity2);
+		
+		location0[particleIndex] += velocity0 - displacement0;
+		location1[particleIndex] += velocity1 - displacement1;
+		location2[particleIndex] += velocity2 - displacement2;
+		
+		velocity_ext0[particleIndex] = velocity0;
+		velocity_ext1[particleIndex] = velocity1;
+		velocity_ext2[particleIndex] = velocity2;
+	}//particle
+}
+
+void pfem2ParticleHandler::advect_particle_stage(const unsigned int particle, const pfem2CellNodeValues &node_velocities, const double time_step, const double start_weight)
+{
+	const pfem2ParticleShapeWeights shape_weights = particles.get_shape_weights(particle);
+	const double dt = time_step / particles.movement_steps[particle];
+	
+	Tensor<1,3> velocity;
+	for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex)
+		for (unsigned int d = 0; d < 3; ++d) velocity[d] += shape_weights[vertex] * node_velocities[d][vertex];
+	
+	const Tensor<1,3> displacement = particles.get_velocity_ext(particle);
+	const Tensor<1,3> new_displacement = (1.0 - start_weight) * (displacement + dt * velocity);
+	
+	particles.set_location(particle, particles.get_location(particle) + (new_displacement - displacement));
+	particles.set_velocity_ext(particle, new_displacement);
+}
+
+int pfem2ParticleHandler::relocate_particle(const unsigned int particle)
+{
+	const int cell_index = particles.cell_indices[particle];
+	
+	bool incremental;
+	const pfem2ParticleMigration migration = locate_particle(particle, cell_index, incremental);
+	if(migration.cell < 0) return -1;
+	
+	if(migration.cell != cell_index){
+		particles.cell_indices[particle] = migration.cell;
+#pragma omp atomic write
+		buckets_outdated = true;
+	}
+	
+	particles.set_reference_location(particle, migration.reference_location);
+	
+	return migration.cell;
+}
+
+unsigned int pfem2ParticleHandler::get_movement_steps (const unsigned int particle) const
+{
+	return particles.movement_steps[particle];
+}
+
+pfem2ParticleMigration pfem2ParticleHandler::locate_particle(const unsigned int particle, const int cell_index, bool &incremental) const
+{
+	const Point<3> particle_location = particles.get_location(particle);
+	
+	pfem2ParticleMigration migration;
+	migration.particle = particle;
+	migration.cell = cell_index;
+	incremental = false;
+	
+#ifdef INCREMENTAL_PARTICLE_RELOCATION
+	//частица, заведомо оставшаяся внутри ячейки: локальные координаты уточняются от прежних одним шагом метода Ньютона
+	if(cell_geometries[cell_index].update_unit_point(particle_location, to_double_point(particles.reference_locations[particle]), migration.reference_location)){
+		incremental = true;
+		return migration;
+	}
+#endif // INCREMENTAL_PARTICLE_RELOCATION
+	
+	Point<3> p_unit;
+	const pfem2PointLocation location = locate_point_in_cell(cell_index, particle_location, p_unit);
+	
+	if(location == point_inside_cell){
+		migration.reference_location = p_unit;
+		return migration;
+	}
+#ifdef VERBOSE_OUTPUT
+	else if(location == point_transformation_failed){
+#pragma omp critical
+		std::cout << "Transformation failed for particle with global coordinates " << particle_location << " (checked cell index #" << cell_index << ")" << std::endl;
+	}
+#endif // VERBOSE_OUTPUT
+	
+	const typename Triangulation<3>::active_cell_iterator cell(&(*triangulation), triangulation->n_levels()-1, cell_index);
+	return find_cell_for_particle(particle, cell, p_unit);
+}
+
+pfem2ParticleMigration pfem2ParticleHandler::find_cell_for_particle(const unsigned int particle, const typename Triangulation<3>::active_cell_iterator &cell, const Point<3> &p_unit) const
+{
+	pfem2ParticleMigration migration;
+	migration.particle = particle;
+	migration.cell = -1;
+	
+	const Point<3> location = particles.get_location(particle);
+	typename Triangulation<3>::cell_iterator current_cell = cell;
+	Point<3> current_unit = p_unit;
+	
+	for (unsigned int step = 0; step < MAX_PARTICLE_WALK_STEPS; ++step){
+		unsigned int exit_face = numbers::invalid_unsigned_int;
+		double max_violation = 0.0;
+		
+		for (unsigned int d = 0; d < 3; ++d){
+			//грань 2*d соответствует локальной координате d, равной 0, грань 2*d+1 - равной 1
+			const unsigned int face = (current_unit[d] < 0.5) ? 2 * d : 2 * d + 1;
+			const double violation = (current_unit[d] < 0.5) ? -current_unit[d] : current_unit[d] - 1.0;
+			
+			if (violation > max_violation && !current_cell->at_boundary(face)){
+				max_violation = violation;
+				exit_face = face;
+			}
+		}
+		
+		//частица вышла за границу области или уперлась в нее
+		if (exit_face == numbers::invalid_unsigned_int) break;
+		
+		current_cell = current_cell->neighbor(exit_face);
+		
+		if (locate_point_in_cell(current_cell->index(), location, current_unit) == point_inside_cell){
+			migration.cell = current_cell->index();
+			migration.reference_location = current_unit;
+			return migration;
+		}
+	}
+	
+	//глобальный поиск среди ячеек, габариты которых содержат частицу (ячейки просматриваются в порядке номеров)
+	const unsigned int bin = cell_search_grid.find_bin(location);
+	if (bin == numbers::invalid_unsigned_int) return migration;
+	
+	for (unsigned int k = cell_search_grid.bin_offsets[bin]; k < cell_search_grid.bin_offsets[bin + 1]; ++k)
+		if (locate_point_in_cell(cell_search_grid.bin_cells[k], location, current_unit) == point_inside_cell){
+			migration.cell = cell_search_grid.bin_cells[k];
+			migration.reference_location = current_unit;
+			break;
+		}
+	
+	return migration;
+}
+
+void pfem2ParticleHandler::sort_particles_into_subdomains_and_cells()
+{
+#ifdef VERBOSE_OUTPUT
+	std::cout << "Started sorting particles..." << std::endl;
+	double start = omp_get_wtime();
+#endif // VERBOSE_OUTPUT
+	
+	const int n_cells = triangulation->n_cells(triangulation->n_levels()-1);
+	
+	migration_buffers.resize(omp_get_max_threads());
+	for(unsigned int i = 0; i < migration_buffers.size(); ++i) migration_buffers[i].clear();
+	
+	unsigned int incremental = 0;
+	
+#pragma omp parallel
+	{
+		std::vector<pfem2ParticleMigration> &migrations = migration_buffers[omp_get_thread_num()];
+		
+		//статическое распределение ячеек: буферы потоков, взятые по порядку, перечисляют частицы в порядке ячеек
+#pragma omp for schedule(static) reduction(+:incremental)
+		for(int cellIndex = 0; cellIndex < n_cells; ++cellIndex){
+			const unsigned int endIndex = cell_offsets[cellIndex + 1];
+			
+			for(unsigned int particleIndex = cell_offsets[cellIndex]; particleIndex != endIndex; ++particleIndex){
+				bool located_incrementally;
+				const pfem2ParticleMigration migration = locate_particle(particleIndex, cellIndex, located_incrementally);
+				
+				if(migration.cell == cellIndex){
+					particles.set_reference_location(particleIndex, migration.reference_location);
+					if(located_incrementally) ++incremental;
+					continue;
+				}
+				
+				migrations.push_back(migration);
+			}
+		}
+	}
+
+#ifdef VERBOSE_OUTPUT	
+	double searchEnd = omp_get_wtime();
+	std::cout << "Finished searching cells for gone particles" << std::endl;
+#endif // VERBOSE_OUTPUT
+	
+	last_sort_relocated = 0;
+	last_sort_deleted = 0;
+	last_sort_incremental = incremental;
+	
+	for(unsigned int thread = 0; thread < migration_buffers.size(); ++thread)
+		for(auto it = migration_buffers[thread].begin(); it != migration_buffers[thread].end(); ++it){
+			if(it->cell < 0){
+				remove_particle(it->particle);
+				++last_sort_deleted;
+			} else {
+				particles.cell_indices[it->particle] = it->cell;
+				particles.set_reference_location(it->particle, it->reference_location);
+				++last_sort_relocated;
+			}
+		}
+	
+	if(last_sort_relocated) buckets_outdated = true;
+
+#ifdef VERBOSE_OUTPUT
+	double mergeEnd = omp_get_wtime();
+	std::cout << "N out of mesh = " << last_sort_deleted << std::endl;
+	std::cout << "N located incrementally = " << last_sort_incremental << std::endl;
+#endif // VERBOSE_OUTPUT
+	
+	update_cell_buckets();
+	
+#ifdef VERBOSE_OUTPUT
+	double end = omp_get_wtime();
+	
+	std::cout << "Checking positions and neighbours' search time: " << (searchEnd-start) << " sec. (" << (searchEnd-start)/(end-start)*100 << "% of total)" << std::endl;
+	std::cout << "Migration buffers merge time: " << (mergeEnd-searchEnd) << " sec. (" << (mergeEnd-searchEnd)/(end-start)*100 << "% of total)" << std::endl;
+	std::cout << "Cell buckets rebuild time: " << (end-mergeEnd) << " sec. (" << (end-mergeEnd)/(end-start)*100 << "% of total)" << std::endl;
+	std::cout << "Total sorting time: " << (end - start) << " sec." << std::endl;
+	
+	std::cout << "Finished sorting particles" << std::endl;
+#endif // VERBOSE_OUTPUT
+}
+
+unsigned int pfem2ParticleHandler::n_relocated_particles() const
+{
+	return last_sort_relocated;
+}
+
+unsigned int pfem2ParticleHandler::n_deleted_particles() const
+{
+	return last_sort_deleted;
+}
+
+unsigned int pfem2ParticleHandler::n_incrementally_located_particles() const
+{
+	return last_sort_incremental;
+}
+
+unsigned int pfem2ParticleHandler::begin() const
+{
+	return 0;
+}
+
+unsigned int pfem2ParticleHandler::end() const
+{
+	return global_number_of_particles;
+}
+
+unsigned int pfem2ParticleHandler::particles_in_cell_begin(const typename Triangulation<3>::active_cell_iterator &cell) const
+{
+	return cell_offsets[cell->index()];
+}
+
+unsigned int pfem2ParticleHandler::particles_in_cell_end(const typename Triangulation<3>::active_cell_iterator &cell) const
+{
+	return cell_offsets[cell->index() + 1];
+}
+
+pfem2Solver::pfem2Solver()
+#ifdef GEOMETRIC_MULTIGRID_PRESSURE
+	: tria(MPI_COMM_WORLD,Triangulation<3>::maximum_smoothing,parallel::distributed::Triangulation<3>::construct_multigrid_hierarchy),
+#else
+	: tria(MPI_COMM_WORLD,Triangulation<3>::maximum_smoothing),
+#endif
+	particle_handler(tria, mapping),
+	feVx (1),
+	feVy (1),
+	feVz (1),
+	feP (1),
+	fe(FE_Q<3>(1), 1),
+	dof_handlerVx (tria),
+	dof_handlerVy (tria),
+	dof_handlerVz (tria),
+	dof_handlerP (tria),
+	adaptive_particle_density(false),
+	min_quantities({1,1,1}),
+	salinity_variation_threshold(0.0),
+	velocity_variation_threshold(0.0),
+	particle_integration_order(1),
+	fused_stage_times(),
+	quantities({0,0,0})
+{}
+
+pfem2Solver::~pfem2Solver()
+{
+	
+}
+
+void pfem2Solver::seed_particles_into_cell (const typename DoFHandler<3>::cell_iterator &cell)
 {
 	double hx = 1.0/quantities[0];
 	double hy = 1.0/quantities[1];
     double hz = 1.0/quantities[2];
 	
 	double shapeValue;
+	pfem2ShapeWeights shapeWeights;
+	const unsigned int *cellDoFs = &cell_dof_indices[cell->index() * GeometryInfo<3>::vertices_per_cell];
 	
 	for(unsigned int i = 0; i < quantities[0]; ++i)
 		for(unsigned int j = 0; j < quantities[1]; ++j)
             for(unsigned int k = 0; k < quantities[2]; ++k) {
-                pfem2Particle *particle = new pfem2Particle(
+                pfem2Particle particle(
                         mapping.transform_unit_to_real_cell(cell, Point<3>((i + 1.0 / 2) * hx, (j + 1.0 / 2) * hy,(k + 1.0 / 2) * hz)),
                         Point<3>((i + 1.0 / 2) * hx, (j + 1.0 / 2) * hy, (k + 1.0 / 2) * hz), ++particleCount);
-                particle_handler.insert_particle(particle, cell);
+                
+                compute_shape_weights(particle.get_reference_location(), shapeWeights);
 
                 for (unsigned int vertex = 0; vertex < GeometryInfo<3>::vertices_per_cell; ++vertex) {
-                    shapeValue = fe.shape_value(vertex, particle->get_reference_location());
-
-                    particle->set_velocity_component(particle->get_velocity_component(0) +
-                                                     shapeValue * solutionVx(cell->vertex_dof_index(vertex, 0)), 0);
-                    particle->set_velocity_component(particle->get_velocity_component(1) +
-                                                     shapeValue * solutionVy(cell->vertex_dof_index(vertex, 0)), 1);
-                    particle->set_velocity_component(particle->get_velocity_component(2) +
-                                                     shapeValue * solutionVz(cell->vertex_dof_index(vertex, 0)), 2);
-                    particle->set_salinity(
-                            particle->get_salinity() + shapeValue * solutionSal(cell->vertex_dof_index(vertex, 0)));
+                    shapeValue = shapeWeights[vertex];
+
+                    particle.set_velocity_component(particle.get_velocity_component(0) +
+                                                     shapeValue * solutionVx(cellDoFs[vertex]), 0);
+                    particle.set_velocity_component(particle.get_velocity_component(1) +
+                                                     shapeValue * solutionVy(cellDoFs[vertex]), 1);
+                    particle.set_velocity_component(particle.get_velocity_component(2) +
+                                                     shapeValue * solutionVz(cellDoFs[vertex]), 2);
+                    particle.set_salinity(
+                            particle.get_salinity() + shapeValue * solutionSal(cellDoFs[vertex]));
                 }//vertex
+                
+                particle_handler.insert_particle(particle, cell);
             }
 }
 
-  bool pfem2Solver::check_cell_for_empty_parts (const typename DoFHandler<3>::cell_iterator &cell)
+pfem2ParticleSums::pfem2ParticleSums()
+	: salinity(0.0),
+	mass(0.0),
+	count(0)
+{}
+
+void pfem2ReseedBuffer::clear()
+{
+	particles.clear();
+	particle_cells.clear();
+	removed_particles.clear();
+	changed_cells.clear();
+}
+
+bool pfem2Solver::needs_fine_particles (const unsigned int cell_index) const
+{
+	const unsigned int *cellDoFs = &cell_dof_indices[cell_index * GeometryInfo<3>::vertices_per_cell];
+	
+	double salinity_min = solutionSal(cellDoFs[0]), salinity_max = salinity_min;
+	Tensor<1,3> velocity_min({solutionVx(cellDoFs[0]), solutionVy(cellDoFs[0]), solutionVz(cellDoFs[0])}), velocity_max = velocity_min;
+	
+	for (unsigned int vertex = 1; vertex < GeometryInfo<3>::vertices_per_cell; ++vertex){
+		salinity_min = std::min(salinity_min, solutionSal(cellDoFs[vertex]));
+		salinity_max = std::max(salinity_max, solutionSal(cellDoFs[vertex]));
+		
+		const Tensor<1,3> velocity({solutionVx(cellDoFs[vertex]), solutionVy(cellDoFs[vertex]), solutionVz(cellDoFs[vertex])});
+		for (unsigned int d = 0; d < 3; ++d){
+			velocity_min[d] = std::min(velocity_min[d], velocity[d]);
+			velocity_max[d] = std::max(velocity_max[d], velocity[d]);
+		}
+	}
+	
+	if(salinity_max - salinity_min > salinity_variation_threshold) return true;
+	
+	for (unsigned int d = 0; d < 3; ++d)
+		if(velocity_max[d] - velocity_min[d] > velocity_variation_threshold) return true;
+	
+	return false;
+}
+
+bool pfem2Solver::check_cell_for_empty_parts (const typename DoFHandler<3>::cell_iterator &cell, pfem2ReseedBuffer &buffer)
 {
-	bool res = false;
+	const unsigned int n_removed = buffer.removed_particles.size();
+	const unsigned int n_seeded = buffer.particles.size();
+	
+	const std::vector<unsigned int> &cell_quantities = (adaptive_particle_density && !needs_fine_particles(cell->index())) ? min_quantities : quantities;
+	const unsigned int n_parts = cell_quantities[0] * cell_quantities[1] * cell_quantities[2];
 	
-	std::map<std::vector<unsigned int>, unsigned int> particlesInParts;
-	std::vector<std::unordered_multimap<int, pfem2Particle*>::iterator> particles_to_be_deleted;
+	//счетчики частиц в частях ячейки: часть (i,j,k) - элемент (i * cell_quantities[1] + j) * cell_quantities[2] + k
+	buffer.part_counts.assign(n_parts, 0);
+	if(adaptive_particle_density){
+		buffer.part_survivors.resize(n_parts * MAX_PARTICLES_PER_CELL_PART);
+		buffer.merge_sums.assign(n_parts * MAX_PARTICLES_PER_CELL_PART, pfem2ParticleSums());
+	}
 	
 	//определение, в каких частях ячейки лежат частицы
-	double hx = 1.0/quantities[0];
-	double hy = 1.0/quantities[1];
-    double hz = 1.0/quantities[2];
+	double hx = 1.0/cell_quantities[0];
+	double hy = 1.0/cell_quantities[1];
+    double hz = 1.0/cell_quantities[2];
 	
 	unsigned int num_x, num_y, num_z;
-	for(auto particleIndex = particle_handler.particles_in_cell_begin(cell); particleIndex != particle_handler.particles_in_cell_end(cell); ++particleIndex){
-		num_x = (*particleIndex).second->get_reference_location()(0)/hx;
-		num_y = (*particleIndex).second->get_reference_location()(1)/hy;
-        num_z = (*particleIndex).second->get_reference_location()(2)/hz;
-		particlesInParts[{num_x,num_y, num_z}]++;
-		if(particlesInParts[{num_x,num_y, num_z}] > MAX_PARTICLES_PER_CELL_PART) particles_to_be_deleted.push_back(particleIndex);
+	const unsigned int beginIndex = particle_handler.particles_in_cell_begin(cell);
+	const unsigned int endIndex = particle_handler.particles_in_cell_end(cell);
+	for(unsigned int particleIndex = beginIndex; particleIndex != endIndex; ++particleIndex){
+		const Point<3> reference_location = particle_handler.get_reference_location(particleIndex);
+		
+		//частица на грани с локальной координатой 1 относится к последней части
+		num_x = std::min(static_cast<unsigned int>(reference_location(0)/hx), cell_quantities[0] - 1);
+		num_y = std::min(static_cast<unsigned int>(reference_location(1)/hy), cell_quantities[1] - 1);
+        num_z = std::min(static_cast<unsigned int>(reference_location(2)/hz), cell_quantities[2] - 1);
+		
+		const unsigned int part = (num_x * cell_quantities[1] + num_y) * cell_quantities[2] + num_z;
+		const unsigned int count = ++buffer.part_counts[part];
+		
+		if(count <= MAX_PARTICLES_PER_CELL_PART){
+			if(adaptive_particle_density) buffer.part_survivors[part * MAX_PARTICLES_PER_CELL_PART + count - 1] = particleIndex;
+			continue;
+		}
+		
+		buffer.removed_particles.push_back(particleIndex);
+		
+		//лишние частицы по очереди объединяются с оставляемыми частицами части
+		if(adaptive_particle_density){
+			pfem2ParticleSums &sums = buffer.merge_sums[part * MAX_PARTICLES_PER_CELL_PART + (count - MAX_PARTICLES_PER_CELL_PART - 1) % MAX_PARTICLES_PER_CELL_PART];
+			const double mass = particle_handler.get_mass(particleIndex);
+			sums.reference_location += mass * reference_location;
+			sums.velocity += mass * particle_handler.get_velocity(particleIndex);
+			sums.salinity += mass * particle_handler.get_salinity(particleIndex);
+			sums.mass += mass;
+			++sums.count;
+		}
 	}
 	
+	const pfem2CellGeometry &geometry = particle_handler.cell_geometries[cell->index()];
+	
+	//объединение: оставляемая частица получает средние с весами-массами значения по себе и объединяемым с ней частицам и их суммарную массу
+	if(adaptive_particle_density)
+		for(unsigned int k = 0; k < n_parts * MAX_PARTICLES_PER_CELL_PART; ++k){
+			pfem2ParticleSums &sums = buffer.merge_sums[k];
+			if(!sums.count) continue;
+			
+			const unsigned int survivor = buffer.part_survivors[k];
+			const double mass = particle_handler.get_mass(survivor);
+			sums.reference_location += mass * particle_handler.get_reference_location(survivor);
+			sums.velocity += mass * particle_handler.get_velocity(survivor);
+			sums.salinity += mass * particle_handler.get_salinity(survivor);
+			sums.mass += mass;
+			++sums.count;
+			
+			const Point<3> reference_location(sums.reference_location / sums.mass);
+			particle_handler.set_reference_location(survivor, reference_location);
+			particle_handler.set_location(survivor, geometry.transform_unit_to_real_cell(reference_location));
+			particle_handler.set_velocity(survivor, sums.velocity / sums.mass);
+			particle_handler.set_salinity(survivor, sums.salinity / sums.mass);
+			particle_handler.set_mass(survivor, sums.mass);
+		}
+	
+	//масса частицы, подсеваемой без разделения, - объем части в объемах частей при полном числе частиц
+	const double seeded_mass = static_cast<double>(quantities[0] * quantities[1] * quantities[2]) / n_parts;
+	
 	double shapeValue;
+	pfem2ShapeWeights shapeWeights;
+	const unsigned int *cellDoFs = &cell_dof_indices[cell->index() * GeometryInfo<3>::vertices_per_cell];
 	
-	//проверка каждой части ячейки на количество частиц: при 0 - подсевание 1 частицы в центр
-	for(unsigned int i = 0; i < quantities[0]; i++)
-		for(unsigned int j = 0; j < quantities[1]; j++)
-            for(unsigned int k = 0; k < quantities[2]; k++)
-                if (!particlesInParts[{i, j, k}]) {
-                    pfem2Particle *particle = new pfem2Particle(
-                            mapping.transform_unit_to_real_cell(cell, Point<3>((i + 1.0 / 2) * hx, (j + 1.0 / 2) * hy, (k + 1.0 / 2) * hz)),
-                            Point<3>((i + 1.0 / 2) * hx, (j + 1.0 / 2) * hy, (k + 1.0 / 2) * hz), ++particleCount);
-                    particle_handler.insert_particle(particle, cell);
-
-                    for (unsigned int vertex = 0; vertex < GeometryInfo<3>::vertices_per_cell; ++vertex) {
-                        shapeValue = fe.shape_value(vertex, particle->get_reference_location());
-
-                        particle->set_velocity_component(particle->get_velocity_component(0) +
-                                                         shapeValue * solutionVx(cell->vertex_dof_index(vertex, 0)), 0);
-                        particle->set_velocity_component(particle->get_velocity_component(1) +
-                                                         shapeValue * solutionVy(cell->vertex_dof_index(vertex, 0)), 1);
-                        particle->set_velocity_component(particle->get_velocity_component(2) +
-                                                         shapeValue * solutionVz(cell->vertex_dof_index(vertex, 0)), 2);
-                        particle->set_salinity(
-                                shapeValue * solutionSal(cell->vertex_dof_index(vertex, 0)) + particle->get_salinity());
-                    }//vertex
-
-                    res = true;
+	//проверка каждой части ячейки на количество частиц: при 0 - подсевание 1 частицы в центр (номер частице присваивается при объединении буферов)
+	for(unsigned int i = 0; i < cell_quantities[0]; i++)
+		for(unsigned int j = 0; j < cell_quantities[1]; j++)
+            for(unsigned int k = 0; k < cell_quantities[2]; k++)
+                if (!buffer.part_counts[(i * cell_quantities[1] + j) * cell_quantities[2] + k]) {
+                    const Point<3> reference_location((i + 1.0 / 2) * hx, (j + 1.0 / 2) * hy, (k + 1.0 / 2) * hz);
+                    pfem2Particle particle(geometry.transform_unit_to_real_cell(reference_location), reference_location, 0);
+                    
+                    //разделение: новая частица переносит величины ближайшей оставляемой частицы ячейки и забирает половину ее массы
+                    unsigned int nearest = endIndex;
+                    if(adaptive_particle_density)
+                        for(unsigned int particleIndex = beginIndex; particleIndex != endIndex; ++particleIndex){
+                            if(std::find(buffer.removed_particles.begin() + n_removed, buffer.removed_particles.end(), particleIndex) != buffer.removed_particles.end()) continue;
+                            
+                            if(nearest == endIndex || reference_location.distance_square(particle_handler.get_reference_location(particleIndex)) <
+                                                      reference_location.distance_square(particle_handler.get_reference_location(nearest))) nearest = particleIndex;
+                        }
+                    
+                    if(nearest != endIndex){
+                        const double mass = 0.5 * particle_handler.get_mass(nearest);
+                        particle_handler.set_mass(nearest, mass);
+                        
+                        particle.set_velocity(particle_handler.get_velocity(nearest));
+                        particle.set_salinity(particle_handler.get_salinity(nearest));
+                        particle.set_mass(mass);
+                    } else {
+                        particle.set_mass(seeded_mass);
+
+                        compute_shape_weights(reference_location, shapeWeights);
+
+                        for (unsigned int vertex = 0; vertex < GeometryInfo<3>::vertices_per_cell; ++vertex) {
+                            shapeValue = shapeWeights[vertex];
+
+                            particle.set_velocity_component(particle.get_velocity_component(0) +
+                                                             shapeValue * solutionVx(cellDoFs[vertex]), 0);
+                            particle.set_velocity_component(particle.get_velocity_component(1) +
+                                                             shapeValue * solutionVy(cellDoFs[vertex]), 1);
+                            particle.set_velocity_component(particle.get_velocity_component(2) +
+                                                             shapeValue * solutionVz(cellDoFs[vertex]), 2);
+                            particle.set_salinity(
+                                    shapeValue * solutionSal(cellDoFs[vertex]) + particle.get_salinity());
+                        }//vertex
+                    }
+                    
+                    buffer.particles.push_back(particle);
+                    buffer.particle_cells.push_back(cell->index());
                 }
 	
-	//удаление лишних частиц
-	for(unsigned int i = 0; i < particles_to_be_deleted.size(); ++i){
-		auto it = particles_to_be_deleted.at(i);
-		(*it).second->set_map_position(it);
-		particle_handler.remove_particle((*it).second);
+	const bool res = (buffer.particles.size() != n_seeded) || (buffer.removed_particles.size() != n_removed);
+	if(res) buffer.changed_cells.push_back(cell->index());
+	
+	return res;
+}
+
+void pfem2Solver::reseed_particles()
+{
+	const int n_cells = tria.n_cells(tria.n_levels()-1);
+	
+	reseed_buffers.resize(omp_get_max_threads());
+	for(unsigned int i = 0; i < reseed_buffers.size(); ++i) reseed_buffers[i].clear();
+	
+#pragma omp parallel
+	{
+		pfem2ReseedBuffer &buffer = reseed_buffers[omp_get_thread_num()];
+		
+		//статическое распределение ячеек: буферы потоков, взятые по порядку, перечисляют ячейки по возрастанию номеров
+#pragma omp for schedule(static)
+		for (int cellIndex = 0; cellIndex < n_cells; ++cellIndex){
+			const typename DoFHandler<3>::cell_iterator cell(&tria, tria.n_levels()-1, cellIndex, &dof_handlerVx);
+			check_cell_for_empty_parts(cell, buffer);
+		}
 	}
+	
+	reseeded_cells.clear();
+	
+	//удаление лишних частиц (до подсевания, чтобы подсеваемые частицы заняли освободившиеся места пула)
+	for(unsigned int thread = 0; thread < reseed_buffers.size(); ++thread)
+		for(unsigned int i = 0; i < reseed_buffers[thread].removed_particles.size(); ++i) particle_handler.remove_particle(reseed_buffers[thread].removed_particles[i]);
+	
+	for(unsigned int thread = 0; thread < reseed_buffers.size(); ++thread){
+		pfem2ReseedBuffer &buffer = reseed_buffers[thread];
+		
+		for(unsigned int i = 0; i < buffer.particles.size(); ++i){
+			buffer.particles[i].set_id(++particleCount);
+			particle_handler.insert_particle(buffer.particles[i], typename Triangulation<3>::active_cell_iterator(&tria, tria.n_levels()-1, buffer.particle_cells[i]));
+		}
 		
-	if(!particles_to_be_deleted.empty()) res = true;
+		reseeded_cells.insert(reseeded_cells.end(), buffer.changed_cells.begin(), buffer.changed_cells.end());
+	}
 	
-	return res;
+	particle_handler.update_cell_buckets();
+}
+
+
+void pfem2Solver::create_triangulation_along_curve(const Triangulation<3> &source)
+{
+	//габариты сетки
+	Point<3> lower_corner, upper_corner;
+	bool first_vertex = true;
+	for(unsigned int i = 0; i < source.n_vertices(); ++i)
+		if(source.get_used_vertices()[i]){
+			const Point<3> &v = source.get_vertices()[i];
+			if(first_vertex){
+				lower_corner = upper_corner = v;
+				first_vertex = false;
+			} else for(unsigned int d = 0; d < 3; ++d){
+				lower_corner[d] = std::min(lower_corner[d], v[d]);
+				upper_corner[d] = std::max(upper_corner[d], v[d]);
+			}
+		}
+	
+	//упорядочение ячеек по номеру центра на кривой (при совпадении номеров - по исходному порядку)
+	std::vector<typename Triangulation<3>::active_cell_iterator> source_cells;
+	std::vector<std::pair<std::uint64_t, unsigned int>> cell_keys;
+	source_cells.reserve(source.n_active_cells());
+	cell_keys.reserve(source.n_active_cells());
+	
+	for(auto cell = source.begin_active(); cell != source.end(); ++cell){
+		cell_keys.emplace_back(hilbert_curve_index(cell->center(), lower_corner, upper_corner - lower_corner), source_cells.size());
+		source_cells.push_back(cell);
+	}
+	
+	std::sort(cell_keys.begin(), cell_keys.end());
+	
+	std::vector<unsigned int> new_vertex_index(source.n_vertices(), numbers::invalid_unsigned_int);
+	std::vector<Point<3>> vertices;
+	std::vector<CellData<3>> cells(cell_keys.size());
+	SubCellData subcelldata;
+	
+	vertices.reserve(source.n_used_vertices());
+	
+	for(unsigned int i = 0; i < cell_keys.size(); ++i){
+		const typename Triangulation<3>::active_cell_iterator &cell = source_cells[cell_keys[i].second];
+		
+		for (unsigned int v = 0; v < GeometryInfo<3>::vertices_per_cell; ++v){
+			unsigned int &vertex = new_vertex_index[cell->vertex_index(v)];
+			if(vertex == numbers::invalid_unsigned_int){
+				vertex = vertices.size();
+				vertices.push_back(cell->vertex(v));
+			}
+			
+			cells[i].vertices[v] = vertex;
+		}
+		
+		cells[i].material_id = cell->material_id();
+	}
+	
+	//номера границ (кроме номера по умолчанию) передаются через граничные грани
+	for(unsigned int i = 0; i < cell_keys.size(); ++i){
+		const typename Triangulation<3>::active_cell_iterator &cell = source_cells[cell_keys[i].second];
+		
+		for (unsigned int face_number = 0; face_number < GeometryInfo<3>::faces_per_cell; ++face_number)
+			if(cell->face(face_number)->at_boundary() && cell->face(face_number)->boundary_id() != 0){
+				CellData<2> quad;
+				for (unsigned int v = 0; v < GeometryInfo<3>::vertices_per_face; ++v) quad.vertices[v] = new_vertex_index[cell->face(face_number)->vertex_index(v)];
+				quad.boundary_id = cell->face(face_number)->boundary_id();
+				
+				subcelldata.boundary_quads.push_back(quad);
+			}
+	}
+	
+	tria.create_triangulation(vertices, cells, subcelldata);
+	
+	std::cout << "Cells and vertices renumbered along the Hilbert curve" << std::endl;
+}
+
+void pfem2Solver::initialize_cell_dof_indices()
+{
+	cell_dof_indices.resize(tria.n_cells(tria.n_levels()-1) * GeometryInfo<3>::vertices_per_cell);
+	
+	typename DoFHandler<3>::cell_iterator cell = dof_handlerVx.begin(tria.n_levels()-1), endc = dof_handlerVx.end(tria.n_levels()-1);
+	for (; cell != endc; ++cell)
+		for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex)
+			cell_dof_indices[cell->index() * GeometryInfo<3>::vertices_per_cell + vertex] = cell->vertex_dof_index(vertex,0);
 }
 
 void pfem2Solver::seed_particles(const std::vector < unsigned int > & quantities)
@@ -603,10 +1495,13 @@ void pfem2Solver::seed_particles(const std::vector < unsigned int > & quantities
 	
 	this->quantities = quantities;
 	
+	//запас пула на частицы, подсеваемые в ходе расчета
+	particle_handler.reserve(2 * tria.n_cells(tria.n_levels()-1) * quantities[0] * quantities[1] * quantities[2]);
+	
 	typename DoFHandler<3>::cell_iterator cell = dof_handlerVx.begin(tria.n_levels()-1), endc = dof_handlerVx.end(tria.n_levels()-1);
 	for (; cell != endc; ++cell) seed_particles_into_cell(cell);
 		
-	//particle_handler.update_cached_numbers();
+	particle_handler.update_cell_buckets();
 	
 	std::cout << "Created and placed " << particleCount << " particles" << std::endl;
 	std::cout << "Particle handler contains " << particle_handler.n_global_particles() << " particles" << std::endl;
@@ -616,61 +1511,175 @@ void pfem2Solver::correct_particles_velocities()
 {
 	TimerOutput::Scope timer_section(*timer, "Particles' velocities correction");
 	
-	double shapeValue;
+	const int n_cells = tria.n_cells(tria.n_levels()-1);
+	
+#pragma omp parallel for schedule(static)
+	for (int cellIndex = 0; cellIndex < n_cells; ++cellIndex){
+		const typename DoFHandler<3>::cell_iterator cell(&tria, tria.n_levels()-1, cellIndex, &dof_handlerVx);
+		
+		//изменение поля скоростей в узлах ячейки
+		pfem2CellNodeValues node_velocity, node_old_velocity;
+		get_cell_node_values(cellIndex, solutionVx, solutionVy, solutionVz, node_velocity);
+		get_cell_node_values(cellIndex, old_solutionVx, old_solutionVy, old_solutionVz, node_old_velocity);
+		
+		for (unsigned int component = 0; component < 3; ++component)
+			for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex) node_velocity[component][vertex] -= node_old_velocity[component][vertex];
+		
+		particle_handler.add_interpolated_velocities(cell, node_velocity);
+	}
+	
+	//std::cout << "Finished correcting particles' velocities" << std::endl;	
+}
+
+unsigned int pfem2Solver::compute_cell_movement_steps()
+{
+	const int n_cells = tria.n_cells(tria.n_levels()-1);
+	unsigned int max_steps = 1;
+	
+	cell_movement_steps.resize(n_cells);
+	
+#pragma omp parallel for schedule(static) reduction(max:max_steps)
+	for (int cellIndex = 0; cellIndex < n_cells; ++cellIndex){
+		pfem2CellNodeValues node_velocity;
+		get_cell_node_values(cellIndex, solutionVx, solutionVy, solutionVz, node_velocity);
+		
+		const Tensor<2,3> &inverse_jacobian = particle_handler.cell_geometries[cellIndex].inverse_jacobian;
+		double cfl = 0.0;
+		
+		for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex){
+			const Tensor<1,3> unit_velocity = inverse_jacobian * Tensor<1,3>({node_velocity[0][vertex], node_velocity[1][vertex], node_velocity[2][vertex]});
 			
-	typename DoFHandler<3>::cell_iterator cell = dof_handlerVx.begin(tria.n_levels()-1), endc = dof_handlerVx.end(tria.n_levels()-1);
-	for (; cell != endc; ++cell)
-		for(auto particleIndex = particle_handler.particles_in_cell_begin(cell); 
-		                                   particleIndex != particle_handler.particles_in_cell_end(cell); ++particleIndex)		
-			for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex){
-				shapeValue = fe.shape_value(vertex, (*particleIndex).second->get_reference_location());
+			for (unsigned int d = 0; d < 3; ++d) cfl = std::max(cfl, std::fabs(unit_velocity[d]) * time_step);
+		}//vertex
+		
+		cell_movement_steps[cellIndex] = std::min(std::max(static_cast<unsigned int>(std::ceil(cfl / MAX_PARTICLE_CFL)), 1u), static_cast<unsigned int>(MAX_PARTICLES_MOVEMENT_STEPS));
+		max_steps = std::max(max_steps, cell_movement_steps[cellIndex]);
+	}//cell
+	
+#ifdef VERBOSE_OUTPUT
+	std::cout << "Particle movement steps: up to " << max_steps << " per cell" << std::endl;
+#endif // VERBOSE_OUTPUT
+	
+	return max_steps;
+}
 
-				(*particleIndex).second->set_velocity_component((*particleIndex).second->get_velocity_component(0) + shapeValue * ( solutionVx(cell->vertex_dof_index(vertex,0)) - old_solutionVx(cell->vertex_dof_index(vertex,0)) ), 0);
-				(*particleIndex).second->set_velocity_component((*particleIndex).second->get_velocity_component(1) + shapeValue * ( solutionVy(cell->vertex_dof_index(vertex,0)) - old_solutionVy(cell->vertex_dof_index(vertex,0)) ), 1);
-                (*particleIndex).second->set_velocity_component((*particleIndex).second->get_velocity_component(2) + shapeValue * ( solutionVz(cell->vertex_dof_index(vertex,0)) - old_solutionVz(cell->vertex_dof_index(vertex,0)) ), 2);
-            }//vertex
+void pfem2Solver::advect_particles_stages(const double time_step, unsigned int &relocated, unsigned int &deleted)
+{
+	const int n_cells = tria.n_cells(tria.n_levels()-1);
+	const unsigned int order = particle_integration_order;
 	
-	//std::cout << "Finished correcting particles' velocities" << std::endl;	
+	for (unsigned int stage = 1; stage < order; ++stage){
+#pragma omp parallel for schedule(static)
+		for (int cellIndex = 0; cellIndex < n_cells; ++cellIndex){
+			const typename DoFHandler<3>::cell_iterator cell(&tria, tria.n_levels()-1, cellIndex, &dof_handlerVx);
+			
+			pfem2CellNodeValues node_velocity;
+			get_cell_node_values(cellIndex, solutionVx, solutionVy, solutionVz, node_velocity);
+			
+			particle_handler.advect_stage_in_cell(cell, node_velocity, time_step, rk_start_weights[order - 1][stage]);
+		}//cell
+		
+		particle_handler.sort_particles_into_subdomains_and_cells();
+		
+		relocated += particle_handler.n_relocated_particles();
+		deleted += particle_handler.n_deleted_particles();
+	}//stage
 }
 
-void pfem2Solver::move_particles() //перенос частиц
+void pfem2Solver::advect_particles_substeps(unsigned int &relocated, unsigned int &deleted)
 {
-	TimerOutput::Scope timer_section(*timer, "Particles' movement");	
+	const unsigned int order = particle_integration_order;
 	
-	Tensor<1,3> vel_in_part;
+	//частицы, продолжающие перемещение (в порядке ячеек)
+	std::vector<unsigned int> substepping_particles;
+	for (unsigned int particleIndex = particle_handler.begin(); particleIndex != particle_handler.end(); ++particleIndex)
+		if(particle_handler.get_movement_steps(particleIndex) > 1) substepping_particles.push_back(particleIndex);
 	
-	double shapeValue;
-	double min_time_step = time_step / PARTICLES_MOVEMENT_STEPS;
+	const int n_substepping = substepping_particles.size();
+	std::vector<std::vector<unsigned int>> lost_particles(omp_get_max_threads());
+	unsigned int substeps_relocated = 0;
 	
-	for (int np_m = 0; np_m < PARTICLES_MOVEMENT_STEPS; ++np_m) {
-		typename DoFHandler<3>::cell_iterator cell = dof_handlerVx.begin(tria.n_levels()-1), endc = dof_handlerVx.end(tria.n_levels()-1);
+#pragma omp parallel reduction(+:substeps_relocated)
+	{
+		std::vector<unsigned int> &lost = lost_particles[omp_get_thread_num()];
 		
-		for (; cell != endc; ++cell)
-			for(auto particleIndex = particle_handler.particles_in_cell_begin(cell); 
-		                                   particleIndex != particle_handler.particles_in_cell_end(cell); ++particleIndex ) {
-				vel_in_part = Tensor<1,3> ({0.0,0.0,0.0});
-				
-				for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex){
-					shapeValue = fe.shape_value(vertex, (*particleIndex).second->get_reference_location());
-					vel_in_part[0] += shapeValue * solutionVx(cell->vertex_dof_index(vertex,0));
-					vel_in_part[1] += shapeValue * solutionVy(cell->vertex_dof_index(vertex,0));
-                    vel_in_part[2] += shapeValue * solutionVz(cell->vertex_dof_index(vertex,0));
-                }//vertex
-				
-				vel_in_part[0] *= min_time_step;
-				vel_in_part[1] *= min_time_step;
-                vel_in_part[2] *= min_time_step;
+		//каждая частица изменяется только своей итерацией, поэтому результат не зависит от числа потоков
+#pragma omp for schedule(static)
+		for (int k = 0; k < n_substepping; ++k){
+			const unsigned int particleIndex = substepping_particles[k];
+			const unsigned int n_steps = particle_handler.get_movement_steps(particleIndex);
+			int cellIndex = particle_handler.get_surrounding_cell(particleIndex)->index();
+			
+			for (unsigned int np_m = 1; np_m < n_steps && cellIndex >= 0; ++np_m){
+				//смещение отсчитывается от начала подшага
+				particle_handler.set_velocity_ext(particleIndex, Tensor<1,3>());
 				
-				(*particleIndex).second->set_location((*particleIndex).second->get_location() + vel_in_part);
-				(*particleIndex).second->set_velocity_ext(vel_in_part);
-			}//particle
+				for (unsigned int stage = 0; stage < order && cellIndex >= 0; ++stage){
+					pfem2CellNodeValues node_velocity;
+					get_cell_node_values(cellIndex, solutionVx, solutionVy, solutionVz, node_velocity);
+					
+					particle_handler.advect_particle_stage(particleIndex, node_velocity, time_step, rk_start_weights[order - 1][stage]);
+					
+					const int newCellIndex = particle_handler.relocate_particle(particleIndex);
+					if(newCellIndex < 0) lost.push_back(particleIndex);
+					else if(newCellIndex != cellIndex) ++substeps_relocated;
+					
+					cellIndex = newCellIndex;
+				}//stage
+			}//np_m
+		}//particle
+	}
+	
+	relocated += substeps_relocated;
+	
+	for(unsigned int thread = 0; thread < lost_particles.size(); ++thread){
+		for(unsigned int i = 0; i < lost_particles[thread].size(); ++i) particle_handler.remove_particle(lost_particles[thread][i]);
+		deleted += lost_particles[thread].size();
+	}
+	
+	particle_handler.update_cell_buckets();
+}
+
+void pfem2Solver::move_particles() //перенос частиц
+{
+	{
+		TimerOutput::Scope timer_section(*timer, "Particles' movement");
+		
+		const int n_cells = tria.n_cells(tria.n_levels()-1);
+		const unsigned int max_steps = compute_cell_movement_steps();
+		
+		unsigned int relocated = 0, deleted = 0;
+		
+		//первый подшаг всех частиц: каждый поток изменяет только частицы своих ячеек, поэтому результат не зависит от числа потоков
+#pragma omp parallel for schedule(static)
+		for (int cellIndex = 0; cellIndex < n_cells; ++cellIndex){
+			const typename DoFHandler<3>::cell_iterator cell(&tria, tria.n_levels()-1, cellIndex, &dof_handlerVx);
+			
+			pfem2CellNodeValues node_velocity;
+			get_cell_node_values(cellIndex, solutionVx, solutionVy, solutionVz, node_velocity);
+			
+			particle_handler.advect_in_cell(cell, node_velocity, time_step, cell_movement_steps[cellIndex]);
+		}//cell
 		
 		particle_handler.sort_particles_into_subdomains_and_cells();
-	}//np_m
+		
+		relocated += particle_handler.n_relocated_particles();
+		deleted += particle_handler.n_deleted_particles();
+		
+		advect_particles_stages(time_step, relocated, deleted);
+		
+		//остальные подшаги - только частицы ячеек с большими скоростями
+		if(max_steps > 1) advect_particles_substeps(relocated, deleted);
+		
+		std::cout << "Particles relocated: " << relocated << ", deleted: " << deleted << std::endl;
+	}
 	
-	//проверка наличия пустых ячеек (без частиц) и размещение в них частиц
-	typename DoFHandler<3>::cell_iterator cell = dof_handlerVx.begin(tria.n_levels()-1), endc = dof_handlerVx.end(tria.n_levels()-1);	
-	for (; cell != endc; ++cell) check_cell_for_empty_parts(cell);
+	{
+		TimerOutput::Scope timer_section(*timer, "Particles' reseeding");
+		
+		//проверка наличия пустых ячеек (без частиц) и размещение в них частиц
+		reseed_particles();
+	}
 	
 	//std::cout << "Finished moving particles" << std::endl;
 }
@@ -678,174 +1687,172 @@ void pfem2Solver::move_particles() //перенос частиц
 void pfem2Solver::distribute_particle_velocities_to_grid() //перенос скоростей частиц на узлы сетки
 {	
 	TimerOutput::Scope timer_section(*timer, "Distribution of particles' velocities to grid nodes");
-		
-	Vector<double> node_velocityX, node_velocityY,node_velocityZ, node_salinity;
-	Vector<double> node_weights;
 	
-	double shapeValue;
+	project_particles_to_grid();
+}
+
+void pfem2Solver::get_cell_node_values (const unsigned int cell_index, const Vector<double> &fieldX, const Vector<double> &fieldY,
+										const Vector<double> &fieldZ, pfem2CellNodeValues &node_values) const
+{
+	const unsigned int *cellDoFs = &cell_dof_indices[cell_index * GeometryInfo<3>::vertices_per_cell];
 	
-	node_velocityX.reinit (tria.n_vertices());
-	node_velocityY.reinit (tria.n_vertices());
-    node_velocityZ.reinit (tria.n_vertices());
-	node_salinity.reinit(tria.n_vertices());
-	node_weights.reinit (tria.n_vertices());
+	for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex){
+		const unsigned int dof = cellDoFs[vertex];
+		node_values[0][vertex] = fieldX(dof);
+		node_values[1][vertex] = fieldY(dof);
+		node_values[2][vertex] = fieldZ(dof);
+	}//vertex
+}
+
+void pfem2Solver::project_particles_to_grid()
+{
+	const int n_cells = tria.n_cells(tria.n_levels()-1);
+	const int n_vertices = tria.n_vertices();
 	
-	typename DoFHandler<3>::cell_iterator cell = dof_handlerVx.begin(tria.n_levels()-1), endc = dof_handlerVx.end(tria.n_levels()-1);
-	for (; cell != endc; ++cell)
-		for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex)
-			for (auto particleIndex = particle_handler.particles_in_cell_begin(cell); 
-	                                   particleIndex != particle_handler.particles_in_cell_end(cell); ++particleIndex ){										   
-				shapeValue = fe.shape_value(vertex, (*particleIndex).second->get_reference_location());
-										   
-				node_velocityX[cell->vertex_dof_index(vertex,0)] += shapeValue * (*particleIndex).second->get_velocity_component(0);
-				node_velocityY[cell->vertex_dof_index(vertex,0)] += shapeValue * (*particleIndex).second->get_velocity_component(1);
-                node_velocityZ[cell->vertex_dof_index(vertex,0)] += shapeValue * (*particleIndex).second->get_velocity_component(2);
-                node_salinity[cell->vertex_dof_index(vertex,0)] +=  shapeValue * (*particleIndex).second->get_salinity();
-				node_weights[cell->vertex_dof_index(vertex,0)] += shapeValue;			
-			}//particle
-	
-	for (unsigned int i = 0; i < tria.n_vertices(); ++i) {
-		node_velocityX[i] /= node_weights[i];
-		node_velocityY[i] /= node_weights[i];
-        node_velocityZ[i] /= node_weights[i];
-        node_salinity[i] /= node_weights[i];
-	}//i
-
-	solutionVx = node_velocityX;
-	solutionVy = node_velocityY;
-    solutionVz = node_velocityZ;
-	solutionSal = node_salinity;
+	cell_projection_sums.resize(n_cells * GeometryInfo<3>::vertices_per_cell);
+	
+	//вклады частиц каждой ячейки в ее вершины
+#pragma omp parallel for schedule(static)
+	for (int cellIndex = 0; cellIndex < n_cells; ++cellIndex){
+		const typename DoFHandler<3>::cell_iterator cell(&tria, tria.n_levels()-1, cellIndex, &dof_handlerVx);
+		const unsigned int endIndex = particle_handler.particles_in_cell_end(cell);
+		pfem2ProjectionSums *sums = &cell_projection_sums[cellIndex * GeometryInfo<3>::vertices_per_cell];
+		
+		for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex){
+			sums[vertex].velocity = Tensor<1,3>();
+			sums[vertex].salinity = 0.0;
+			sums[vertex].weight = 0.0;
+		}//vertex
+		
+		for (unsigned int particleIndex = particle_handler.particles_in_cell_begin(cell); particleIndex != endIndex; ++particleIndex){
+			const pfem2ParticleShapeWeights shapeWeights = particle_handler.get_shape_weights(particleIndex);
+			const Tensor<1,3> velocity = particle_handler.get_velocity(particleIndex);
+			const double salinity = particle_handler.get_salinity(particleIndex);
+			const double mass = particle_handler.get_mass(particleIndex);
+			
+			for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex){
+				const double weight = mass * shapeWeights[vertex];
+				sums[vertex].velocity += weight * velocity;
+				sums[vertex].salinity += weight * salinity;
+				sums[vertex].weight += weight;
+			}//vertex
+		}//particle
+	}//cell
+	
+	//сбор вкладов в вершинах: ячейки вершины перебираются в порядке номеров (vertex_to_cell_indices)
+#pragma omp parallel for schedule(static)
+	for (int vertexIndex = 0; vertexIndex < n_vertices; ++vertexIndex){
+		const unsigned int endIndex = particle_handler.vertex_to_cell_offsets[vertexIndex + 1];
+		if(particle_handler.vertex_to_cell_offsets[vertexIndex] == endIndex) continue;
+		
+		pfem2ProjectionSums node_sums;
+		node_sums.salinity = 0.0;
+		node_sums.weight = 0.0;
+		
+		for (unsigned int k = particle_handler.vertex_to_cell_offsets[vertexIndex]; k != endIndex; ++k){
+			const pfem2ProjectionSums &sums = cell_projection_sums[particle_handler.vertex_to_cell_indices[k] * GeometryInfo<3>::vertices_per_cell
+																   + particle_handler.vertex_to_cell_vertex_numbers[k]];
+			node_sums.velocity += sums.velocity;
+			node_sums.salinity += sums.salinity;
+			node_sums.weight += sums.weight;
+		}//k
+		
+		const unsigned int firstIndex = particle_handler.vertex_to_cell_offsets[vertexIndex];
+		const unsigned int dof = cell_dof_indices[particle_handler.vertex_to_cell_indices[firstIndex] * GeometryInfo<3>::vertices_per_cell
+												  + particle_handler.vertex_to_cell_vertex_numbers[firstIndex]];
+		solutionVx(dof) = node_sums.velocity[0] / node_sums.weight;
+		solutionVy(dof) = node_sums.velocity[1] / node_sums.weight;
+		solutionVz(dof) = node_sums.velocity[2] / node_sums.weight;
+		solutionSal(dof) = node_sums.salinity / node_sums.weight;
+	}//vertexIndex
 	
 	for(std::set<unsigned int>::iterator num = boundaryDoFNumbers.begin(); num != boundaryDoFNumbers.end(); ++num) solutionSal(*num) = 0.0;
+}
+
+void pfem2Solver::advance_particles()
+{
+	const int n_cells = tria.n_cells(tria.n_levels()-1);
 	
-	return;
-	
-	SolverControl solver_control(1000, 1e-12);
-	SolverGMRES<Vector<double>> solver(solver_control);
-	
-	/*typename DoFHandler<3>::cell_iterator cell = dof_handlerVx.begin(tria.n_levels()-1), endc = dof_handlerVx.end(tria.n_levels()-1);
-	for (; cell != endc; ++cell) {	
-		FullMatrix<double> B_all(projection_func_count);
-		Vector<double> fx(projection_func_count);
-		Vector<double> fy(projection_func_count);
-		Vector<double> fz(projection_func_count);
-		Vector<double> fsalinity(projection_func_count);
-		Vector<double> cx(projection_func_count);
-		Vector<double> cy(projection_func_count);
-		Vector<double> cz(projection_func_count);
-		Vector<double> csalinity(projection_func_count);
-		
-		for (auto particleIndex = particle_handler.particles_in_cell_begin(cell); particleIndex != particle_handler.particles_in_cell_end(cell); ++particleIndex ){
-			Vector<double> b(projection_func_count);
-
-			if(PROJECTION_FUNCTIONS_DEGREE == 1){
-				b[0] = 1.0;
-				b[1] = (*particleIndex).second->get_location()[0] - cell->center()[0];
-				b[2] = (*particleIndex).second->get_location()[1] - cell->center()[1];
-				b[3] = (*particleIndex).second->get_location()[2] - cell->center()[2];
-			}
-			
-			double weight = exp(-cell->center().distance_square((*particleIndex).second->get_location()) / h / h);
-
-			fx.add((*particleIndex).second->get_velocity_component(0) * weight, b);
-			fy.add((*particleIndex).second->get_velocity_component(1) * weight, b);
-			fz.add((*particleIndex).second->get_velocity_component(2) * weight, b);
-			fsalinity.add((*particleIndex).second->get_salinity() * weight, b);
-							
-			FullMatrix<double> B(projection_func_count);
-			B.outer_product(b,b);
-			B.equ(weight, B);
-
-			B_all.add(1,B);
-		}
-			
-		solver.solve(B_all, cx, fx, PreconditionIdentity());
-		solver.solve(B_all, cy, fy, PreconditionIdentity());
-		solver.solve(B_all, cz, fz, PreconditionIdentity());
-		solver.solve(B_all, csalinity, fsalinity, PreconditionIdentity());
+	//время коррекции - максимум по потокам времени, проведенного потоком в коррекции (потоки выполняют ее одновременно)
+	double correction_time = 0.0;
+	double stage_start = omp_get_wtime();
+	
+	{
+		TimerOutput::Scope timer_section(*timer, "Particles' movement");
+		
+		const unsigned int max_steps = compute_cell_movement_steps();
 		
-		for(unsigned int vert = 0; vert < GeometryInfo<3>::vertices_per_cell; ++vert){
-			Vector<double> b(projection_func_count);
+		unsigned int relocated = 0, deleted = 0;
+		
+#pragma omp parallel reduction(max:correction_time)
+		{
+			double thread_correction_time = 0.0;
 			
-			if(PROJECTION_FUNCTIONS_DEGREE == 1){
-				b[0] = 1.0;
-				b[1] = cell->vertex(vert)[0] - cell->center()[0];
-				b[2] = cell->vertex(vert)[1] - cell->center()[1];
-				b[3] = cell->vertex(vert)[2] - cell->center()[2];
-			}
+#pragma omp for schedule(static)
+			for (int cellIndex = 0; cellIndex < n_cells; ++cellIndex){
+				const typename DoFHandler<3>::cell_iterator cell(&tria, tria.n_levels()-1, cellIndex, &dof_handlerVx);
+				
+				//узловые значения ячейки читаются один раз для всех ее частиц
+				pfem2CellNodeValues node_velocity;
+				get_cell_node_values(cellIndex, solutionVx, solutionVy, solutionVz, node_velocity);
+				
+				//коррекция скоростей частиц (как в correct_particles_velocities())
+				const double correction_start = omp_get_wtime();
+				
+				pfem2CellNodeValues node_correction;
+				get_cell_node_values(cellIndex, old_solutionVx, old_solutionVy, old_solutionVz, node_correction);
+				
+				for (unsigned int component = 0; component < 3; ++component)
+					for (unsigned int vertex=0; vertex<GeometryInfo<3>::vertices_per_cell; ++vertex)
+						node_correction[component][vertex] = node_velocity[component][vertex] - node_correction[component][vertex];
+				
+				particle_handler.add_interpolated_velocities(cell, node_correction);
+				
+				thread_correction_time += omp_get_wtime() - correction_start;
+				
+				//первый подшаг перемещения
+				particle_handler.advect_in_cell(cell, node_velocity, time_step, cell_movement_steps[cellIndex]);
+			}//cell
 			
-			node_velocityX[cell->vertex_dof_index(vert, 0)] += cx * b;
-			node_velocityY[cell->vertex_dof_index(vert, 0)] += cy * b;
-			node_velocityZ[cell->vertex_dof_index(vert, 0)] += cz * b;
-			node_salinity[cell->vertex_dof_index(vert, 0)] += csalinity * b;
-			node_weights[cell->vertex_dof_index(vert, 0)] += 1;
+			correction_time = std::max(correction_time, thread_correction_time);
 		}
+		
+		particle_handler.sort_particles_into_subdomains_and_cells();
+		
+		relocated += particle_handler.n_relocated_particles();
+		deleted += particle_handler.n_deleted_particles();
+		
+		advect_particles_stages(time_step, relocated, deleted);
+		
+		if(max_steps > 1) advect_particles_substeps(relocated, deleted);
+		
+		std::cout << "Particles relocated: " << relocated << ", deleted: " << deleted << std::endl;
 	}
 	
-	for (unsigned int i = 0; i < tria.n_vertices(); ++i) {
-		node_velocityX[i] /= node_weights[i];
-		node_velocityY[i] /= node_weights[i];
-        node_velocityZ[i] /= node_weights[i];
-        node_salinity[i] /= node_weights[i];
-	}//i
-
-	solutionVx = node_velocityX;
-	solutionVy = node_velocityY;
-    solutionVz = node_velocityZ;
-	solutionSal = node_salinity;*/
-	
-	/*for(auto vert = tria.begin_vertex(); vert != tria.end_vertex(); ++vert){
-		FullMatrix<double> B_all(projection_func_count);
-		Vector<double> fx(projection_func_count);
-		Vector<double> fy(projection_func_count);
-		Vector<double> fz(projection_func_count);
-		Vector<double> fsalinity(projection_func_count);
-		Vector<double> cx(projection_func_count);
-		Vector<double> cy(projection_func_count);
-		Vector<double> cz(projection_func_count);
-		Vector<double> csalinity(projection_func_count);
-		
-		std::set<typename Triangulation<3>::active_cell_iterator> surroundingCells = particle_handler.vertex_to_cells[vert->index()];
-		
-		for(auto cell = surroundingCells.begin(); cell != surroundingCells.end(); ++cell){
-			for (auto particleIndex = particle_handler.particles_in_cell_begin(*cell); particleIndex != particle_handler.particles_in_cell_end(*cell); ++particleIndex ){
-				Vector<double> b(projection_func_count);
-
-				Triangulation<3>::active_cell_iterator cellIt = *cell;
-				
-				if(PROJECTION_FUNCTIONS_DEGREE == 1){
-					b[0] = 1.0;
-					b[1] = (*particleIndex).second->get_location()[0] - cellIt->center()[0];
-					b[2] = (*particleIndex).second->get_location()[1] - cellIt->center()[1];
-					b[3] = (*particleIndex).second->get_location()[2] - cellIt->center()[2];
-				}
-					
-				double weight = exp(-vert->center().distance_square((*particleIndex).second->get_location()) / h / h);
-
-				fx.add((*particleIndex).second->get_velocity_component(0) * weight, b);
-				fy.add((*particleIndex).second->get_velocity_component(1) * weight, b);
-				fz.add((*particleIndex).second->get_velocity_component(2) * weight, b);
-				fsalinity.add((*particleIndex).second->get_salinity() * weight, b);
-					
-				FullMatrix<double> B(projection_func_count);
-				B.outer_product(b,b);
-				B.equ(weight, B);
-
-				B_all.add(1,B);
-			}
-		}
-			
-		solver.solve(B_all, cx, fx, PreconditionIdentity());
-		solver.solve(B_all, cy, fy, PreconditionIdentity());
-		solver.solve(B_all, cz, fz, PreconditionIdentity());
-		solver.solve(B_all, csalinity, fsalinity, PreconditionIdentity());
-		
-		solutionVx[verticesDoFnumbers[vert->index()]] = cx[0];
-		solutionVy[verticesDoFnumbers[vert->index()]] = cy[0];
-		solutionVz[verticesDoFnumbers[vert->index()]] = cz[0];
-		solutionSal[verticesDoFnumbers[vert->index()]] = csalinity[0];
-	}*/
-	
-    //for(std::set<unsigned int>::iterator num = boundaryDoFNumbers.begin(); num != boundaryDoFNumbers.end(); ++num) solutionSal(*num) = 0.0;
-	//std::cout << "Finished distributing particles' velocities to grid" << std::endl;	 
+	double stage_end = omp_get_wtime();
+	fused_stage_times[0] += correction_time;
+	fused_stage_times[1] += stage_end - stage_start - correction_time;
+	stage_start = stage_end;
+	
+	{
+		TimerOutput::Scope timer_section(*timer, "Particles' reseeding");
+		
+		//проверка наличия пустых ячеек (без частиц) и размещение в них частиц
+		reseed_particles();
+	}
+	
+	stage_end = omp_get_wtime();
+	fused_stage_times[2] += stage_end - stage_start;
+	stage_start = stage_end;
+	
+	{
+		TimerOutput::Scope timer_section(*timer, "Distribution of particles' velocities to grid nodes");
+		
+		project_particles_to_grid();
+	}
+	
+	fused_stage_times[3] += omp_get_wtime() - stage_start;
+	
+	std::cout << "Fused particle stage wall time (total, sec.): correction " << fused_stage_times[0] << ", movement " << fused_stage_times[1]
+			  << ", reseeding " << fused_stage_times[2] << ", projection " << fused_stage_times[3] << std::endl;
 }
@@ -1,16 +1,20 @@
 #ifndef PFEM2PARTICLE_H
 #define PFEM2PARTICLE_H
 
-#define PARTICLES_MOVEMENT_STEPS 3
+#define MAX_PARTICLE_CFL 0.5
+#define MAX_PARTICLES_MOVEMENT_STEPS 20
 #define MAX_PARTICLES_PER_CELL_PART 3
-
-#define PROJECTION_FUNCTIONS_DEGREE 1
+#define MAX_PARTICLE_WALK_STEPS 16
+#define INCREMENTAL_RELOCATION_MARGIN 0.01
+#define INCREMENTAL_RELOCATION_TOLERANCE 1e-6
 
 #include <iostream>
 #include <fstream>
 #include <cmath>
 #include <ctime>
 #include <unordered_map>
+#include <array>
+#include <cstdint>
 
 #include <deal.II/base/tensor.h>
 #include <deal.II/base/timer.h>
@@ -31,6 +35,38 @@
 
 using namespace dealii;
 
+/*!
+ * \brief Тип хранения данных частиц (координаты, скорости, соленость, значения функций формы)
+ * 
+ * При SINGLE_PRECISION_PARTICLES данные частиц хранятся в float, что вдвое сокращает объем памяти и обращений к ней.
+ * Точность ограничена трилинейной интерполяцией со сетки, а суммы при коррекции, перемещении и проекции вычисляются в double.
+ * Координаты в float имеют относительную точность ~1e-7, поэтому перемещение частицы за подшаг должно заметно превышать 1e-7 от размера области.
+ */
+#ifdef SINGLE_PRECISION_PARTICLES
+typedef float pfem2ParticleNumber;
+#else
+typedef double pfem2ParticleNumber;
+#endif
+
+typedef std::array<double, GeometryInfo<3>::vertices_per_cell> pfem2ShapeWeights;	//!< Значения функций формы Q1 в точке ячейки (по вершинам)
+typedef std::array<pfem2ParticleNumber, GeometryInfo<3>::vertices_per_cell> pfem2ParticleShapeWeights;	//!< Значения функций формы, хранимые для частиц
+typedef double pfem2CellNodeValues[3][GeometryInfo<3>::vertices_per_cell];	//!< Значения трех компонент поля в вершинах ячейки ([компонента][вершина])
+
+/*!
+ * \brief Вычисление значений трилинейных функций формы во всех вершинах ячейки по явным формулам
+ * 
+ * Результат совпадает с FE_Q<3>(1)::shape_value(vertex, reference_location) для vertex = 0..7.
+ */
+template <typename Number>
+void compute_shape_weights(const Point<3> &reference_location, std::array<Number, GeometryInfo<3>::vertices_per_cell> &weights);
+
+/*!
+ * \brief Номер точки p вдоль кривой Гильберта, заполняющей параллелепипед [lower_corner, lower_corner + extent] (по 21 биту на координату)
+ * 
+ * Точки, близкие по номеру, близки и в пространстве, поэтому упорядочение объектов по номеру улучшает локальность обращений к памяти.
+ */
+std::uint64_t hilbert_curve_index(const Point<3> &p, const Point<3> &lower_corner, const Tensor<1,3> &extent);
+
 class pfem2Particle
 {
 public:
@@ -43,11 +79,7 @@ public:
 	const Point<3> & get_reference_location () const;
 	
 	unsigned int get_id () const;
-	
-	void set_tria_position (const int &new_position);
-	
-	void set_map_position (const std::unordered_multimap<int, pfem2Particle*>::iterator &new_position);
-	const std::unordered_multimap<int, pfem2Particle*>::iterator & get_map_position () const;
+	void set_id (const unsigned int new_id);
 	
 	void set_velocity (const Tensor<1,3> &new_velocity);
 	void set_velocity_component (const double value, int component);
@@ -60,24 +92,165 @@ public:
 
 	void set_salinity(const double &new_salinity);
 	const double & get_salinity() const;
-
-	Triangulation<3>::cell_iterator get_surrounding_cell(const Triangulation<3> &triangulation) const;
 	
-	unsigned int find_closest_vertex_of_cell(const typename Triangulation<3>::active_cell_iterator &cell, const Mapping<3> &mapping);
+	void set_mass(const double &new_mass);
+	const double & get_mass() const;
 	
 private:
 	Point<3> location;
 	Point<3> reference_location;
 	unsigned int id;
 
-	int tria_position;
-	std::unordered_multimap<int, pfem2Particle*>::iterator map_position;
-
 	Tensor<1,3> velocity;						 //!< Скорость, которую переносит частица
 	Tensor<1,3> velocity_ext;					 //!< Внешняя скорость (с которой частица переносится)
     double salinity;                           //!<Соленость, которую переносит частица
+	double mass;								 //!< Масса (вес) частицы: доля объема, которую представляет частица, в объемах частей ячейки при полном числе частиц
+};
+
+/*!
+ * \brief Результат определения локальных координат точки в ячейке
+ */
+enum pfem2PointLocation
+{
+	point_inside_cell,								//!< Точка лежит в ячейке
+	point_outside_cell,								//!< Локальные координаты найдены, точка лежит вне ячейки
+	point_transformation_failed						//!< Метод Ньютона не сошелся (локальные координаты заменяются линейным приближением)
+};
+
+/*!
+ * \brief Трилинейное отображение шестигранной ячейки
+ * 
+ * x(u,v,w) = a0 + a1*u + a2*v + a3*w + a4*u*v + a5*u*w + a6*v*w + a7*u*v*w, где a0..a7 - коэффициенты, вычисленные по вершинам ячейки.
+ * Обратное отображение не бросает исключений: для аффинных ячеек локальные координаты вычисляются сразу
+ * по обратной матрице Якоби, для остальных она дает начальное приближение метода Ньютона.
+ */
+struct pfem2CellGeometry
+{
+	void reinit(const typename Triangulation<3>::active_cell_iterator &cell);
+	
+	Point<3> transform_unit_to_real_cell(const Point<3> &p_unit) const;
+	pfem2PointLocation transform_real_to_unit_cell(const Point<3> &p, Point<3> &p_unit) const;
+	
+	/*!
+	 * \brief Матрица Якоби трилинейного отображения в точке p_unit единичной ячейки
+	 */
+	Tensor<2,3> jacobian(const Point<3> &p_unit) const;
+	
+	/*!
+	 * \brief Быстрое обновление локальных координат точки p, сместившейся из точки с локальными координатами p_unit_old
+	 * 
+	 * Выполняется один шаг метода Ньютона от p_unit_old по смещению p - F(p_unit_old) (для аффинной ячейки - точное решение).
+	 * \return true, если p_unit лежит внутри ячейки с запасом INCREMENTAL_RELOCATION_MARGIN и невязка отображения не превышает incremental_tolerance
+	 * (иначе требуется полный поиск через transform_real_to_unit_cell())
+	 */
+	bool update_unit_point(const Point<3> &p, const Point<3> &p_unit_old, Point<3> &p_unit) const;
+	
+	Tensor<1,3> coefficients[8];					//!< Коэффициенты a0..a7 трилинейного отображения
+	Point<3> center;								//!< Образ центра единичной ячейки
+	Tensor<2,3> inverse_jacobian;					//!< Обратная матрица Якоби в центре ячейки
+	double tolerance;								//!< Допустимая невязка метода Ньютона (относительно размера ячейки)
+	double incremental_tolerance;					//!< Допустимая невязка быстрого обновления локальных координат
+	bool affine;									//!< Признак аффинной ячейки (нелинейные коэффициенты пренебрежимо малы)
+};
+
+/*!
+ * \brief Равномерная сетка корзин по габаритным параллелепипедам ячеек
+ * 
+ * Используется для глобального поиска ячейки, содержащей точку: корзина bin содержит номера ячеек
+ * bin_cells[bin_offsets[bin]] ... bin_cells[bin_offsets[bin+1]-1], габариты которых пересекают корзину.
+ */
+struct pfem2CellSearchGrid
+{
+	void reinit(const Triangulation<3> &triangulation);
+	
+	/*!
+	 * \brief Номер корзины, содержащей точку p (numbers::invalid_unsigned_int, если точка вне габаритов сетки)
+	 */
+	unsigned int find_bin(const Point<3> &p) const;
+	
+	Point<3> lower_corner;							//!< Нижний угол габаритов сетки
+	Tensor<1,3> bin_size;							//!< Размеры корзины по направлениям
+	unsigned int n_bins[3];							//!< Количество корзин по направлениям
+	
+	std::vector<unsigned int> bin_offsets;
+	std::vector<unsigned int> bin_cells;
+};
+
+/*!
+ * \brief Массивы данных частиц (структура массивов)
+ * 
+ * Координаты, скорости и значения функций формы, которые читают векторизованные циклы по частицам ячейки, хранятся покомпонентно
+ * (locations[0] - x всех частиц, locations[1] - y и т.д.), поэтому соседние итерации цикла обращаются к соседним элементам массивов без сборки (gather).
+ */
+struct pfem2ParticleArrays
+{
+	std::vector<pfem2ParticleNumber> locations[3];					//!< Координаты частиц (по компонентам)
+	std::vector<Point<3,pfem2ParticleNumber>> reference_locations;	//!< Локальные координаты частиц в их ячейках
+	std::vector<pfem2ParticleNumber> shape_weights[GeometryInfo<3>::vertices_per_cell];	//!< Значения функций формы в локальных координатах частиц (по вершинам ячейки)
+	std::vector<pfem2ParticleNumber> velocities[3];					//!< Скорости, которые переносят частицы (по компонентам)
+	std::vector<pfem2ParticleNumber> velocities_ext[3];				//!< Внешние скорости, с которыми частицы переносятся (по компонентам)
+	std::vector<pfem2ParticleNumber> salinities;					//!< Соленость, которую переносят частицы
+	std::vector<pfem2ParticleNumber> masses;						//!< Массы (веса) частиц
+	std::vector<unsigned int> movement_steps;						//!< Число подшагов перемещения частиц на текущем шаге по времени
+	std::vector<unsigned int> ids;
+	std::vector<int> cell_indices;					//!< Номер ячейки каждой частицы (-1 - место свободно)
+	
+	unsigned int size() const;
+	void resize(const unsigned int n);
+	void reserve(const unsigned int n);
+	void clear();
+	void swap(pfem2ParticleArrays &other);
+	bool sizes_consistent() const;		//!< Все массивы имеют одну длину (проверка после перестроения)
+	
+	void copy_particle(const unsigned int from, pfem2ParticleArrays &destination, const unsigned int to) const;
+	
+	Point<3> get_location(const unsigned int particle) const;
+	void set_location(const unsigned int particle, const Point<3> &location);
+	
+	/*!
+	 * \brief Запись локальных координат частицы и пересчет значений функций формы в них
+	 */
+	void set_reference_location(const unsigned int particle, const Point<3> &reference_location);
+	pfem2ParticleShapeWeights get_shape_weights(const unsigned int particle) const;
+	
+	Tensor<1,3> get_velocity(const unsigned int particle) const;
+	void set_velocity(const unsigned int particle, const Tensor<1,3> &velocity);
+	
+	Tensor<1,3> get_velocity_ext(const unsigned int particle) const;
+	void set_velocity_ext(const unsigned int particle, const Tensor<1,3> &velocity_ext);
+};
+
+/*!
+ * \brief Запись о смене ячейки частицей, найденная при сортировке
+ */
+struct pfem2ParticleMigration
+{
+	unsigned int particle;							//!< Индекс частицы в хранилище
+	int cell;										//!< Номер новой ячейки (-1 - частица покинула расчетную область)
+	Point<3> reference_location;					//!< Локальные координаты частицы в новой ячейке
+};
+
+/*!
+ * \brief Вклад частиц ячейки в одну из ее вершин (суммы с коэффициентами - значениями функций формы)
+ */
+struct pfem2ProjectionSums
+{
+	Tensor<1,3> velocity;
+	double salinity;
+	double weight;									//!< Сумма значений функций формы, умноженных на массы частиц
 };
 
+/*!
+ * \brief Хранилище частиц
+ * 
+ * Данные частиц хранятся в отдельных непрерывных массивах (координаты, локальные координаты, скорости, соленость, масса),
+ * упорядоченных по номерам ячеек: частицы ячейки cell занимают индексы [cell_offsets[cell->index()], cell_offsets[cell->index()+1]).
+ * Вставка и удаление частиц откладываются до вызова update_cell_buckets(), который перестраивает массивы сортировкой подсчетом.
+ * 
+ * Массивы работают как пул: места удаленных частиц заносятся в список свободных и повторно используются при вставке,
+ * а перестроение выполняется во второй (запасной) набор массивов, который затем меняется местами с основным.
+ * Емкость обоих наборов сохраняется между шагами, поэтому в установившемся режиме выделения памяти не происходит.
+ */
 class pfem2ParticleHandler
 {
 public:
@@ -87,8 +260,26 @@ public:
 	void clear();
 	void clear_particles();
 	
-	void remove_particle(const pfem2Particle *particle);
-	void insert_particle(pfem2Particle *particle, const typename Triangulation<3>::active_cell_iterator &cell);
+	/*!
+	 * \brief Пометка частицы к удалению (фактическое удаление - при вызове update_cell_buckets())
+	 */
+	void remove_particle(const unsigned int particle);
+	
+	/*!
+	 * \brief Добавление частицы в ячейку cell (частица становится доступной через particles_in_cell_begin/end после вызова update_cell_buckets())
+	 * \return Индекс места, занятого частицей в хранилище (действителен до вызова update_cell_buckets())
+	 */
+	unsigned int insert_particle(const pfem2Particle &particle, const typename Triangulation<3>::active_cell_iterator &cell);
+	
+	/*!
+	 * \brief Резервирование памяти пула под n_particles частиц
+	 */
+	void reserve(const unsigned int n_particles);
+	
+	/*!
+	 * \brief Перестроение массивов частиц по ячейкам с учетом добавленных, удаленных и сменивших ячейку частиц
+	 */
+	void update_cell_buckets();
 	
 	unsigned int n_global_particles() const;
  
@@ -98,30 +289,184 @@ public:
     
     unsigned int n_particles_in_cell(const typename Triangulation<3>::active_cell_iterator &cell) const;
     
+    /*!
+     * \brief Определение ячеек частиц после их перемещения
+     * 
+     * Поиск выполняется параллельно по ячейкам, каждый поток накапливает найденные перемещения в собственном буфере.
+     * Затем буферы объединяются в порядке номеров потоков и массивы частиц перестраиваются за один проход.
+     */
     void sort_particles_into_subdomains_and_cells();
     
-    std::unordered_multimap<int, pfem2Particle*>::iterator begin();
-    std::unordered_multimap<int, pfem2Particle*>::iterator end();
+    unsigned int n_relocated_particles() const;		//!< Число частиц, сменивших ячейку при последней сортировке
+    unsigned int n_deleted_particles() const;		//!< Число частиц, удаленных при последней сортировке
+    unsigned int n_incrementally_located_particles() const;	//!< Число частиц, локальные координаты которых уточнены без полного обратного отображения при последней сортировке
+    
+    unsigned int begin() const;
+    unsigned int end() const;
+    
+    unsigned int particles_in_cell_begin(const typename Triangulation<3>::active_cell_iterator &cell) const;
+    unsigned int particles_in_cell_end(const typename Triangulation<3>::active_cell_iterator &cell) const;
+    
+    Point<3> get_location (const unsigned int particle) const;
+    void set_location (const unsigned int particle, const Point<3> &new_location);
+    
+    Point<3> get_reference_location (const unsigned int particle) const;
+    void set_reference_location (const unsigned int particle, const Point<3> &new_reference_location);
+    
+    /*!
+     * \brief Значения функций формы ячейки в точке частицы (пересчитываются при каждом изменении локальных координат)
+     */
+    pfem2ParticleShapeWeights get_shape_weights (const unsigned int particle) const;
+    
+    unsigned int get_id (const unsigned int particle) const;
+    
+    Tensor<1,3> get_velocity (const unsigned int particle) const;
+    double get_velocity_component (const unsigned int particle, int component) const;
+    void set_velocity (const unsigned int particle, const Tensor<1,3> &new_velocity);
+    void set_velocity_component (const unsigned int particle, const double value, int component);
+    
+    Tensor<1,3> get_velocity_ext (const unsigned int particle) const;
+    void set_velocity_ext (const unsigned int particle, const Tensor<1,3> &new_ext_velocity);
+    
+    double get_salinity (const unsigned int particle) const;
+    void set_salinity (const unsigned int particle, const double &new_salinity);
+    
+    double get_mass (const unsigned int particle) const;
+    void set_mass (const unsigned int particle, const double &new_mass);
+    
+    Triangulation<3>::active_cell_iterator get_surrounding_cell(const unsigned int particle) const;
     
-    std::unordered_multimap<int, pfem2Particle*>::iterator particles_in_cell_begin(const typename Triangulation<3>::active_cell_iterator &cell);
-    std::unordered_multimap<int, pfem2Particle*>::iterator particles_in_cell_end(const typename Triangulation<3>::active_cell_iterator &cell);
+    /*!
+     * \brief Добавление к скоростям всех частиц ячейки cell значений, интерполированных по узловым значениям node_values
+     * 
+     * Частицы ячейки обрабатываются пакетом (цикл векторизуется по частицам, узловые значения читаются один раз на ячейку,
+     * данные частиц - из покомпонентных массивов pfem2ParticleArrays).
+     */
+    void add_interpolated_velocities(const typename Triangulation<3>::active_cell_iterator &cell, const pfem2CellNodeValues &node_values);
     
-    std::vector<std::set<typename Triangulation<3>::active_cell_iterator>> vertex_to_cells;
-    std::vector<std::vector<Tensor<1,3>>> vertex_to_cell_centers;
+    /*!
+     * \brief Первый из n_steps подшагов перемещения всех частиц ячейки cell по скорости, интерполированной по узловым значениям node_velocities
+     * 
+     * Для каждой частицы dt = time_step / n_steps, location += dt * v, velocity_ext = dt * v. Частицы ячейки обрабатываются пакетом, как в add_interpolated_velocities().
+     * Число подшагов запоминается у частицы: ее последующие стадии и подшаги выполняются с тем же dt, даже если она перешла в ячейку с другим числом подшагов.
+     */
+    void advect_in_cell(const typename Triangulation<3>::active_cell_iterator &cell, const pfem2CellNodeValues &node_velocities, const double time_step, const unsigned int n_steps);
     
+    /*!
+     * \brief Промежуточная стадия метода Рунге-Кутты (в форме Шу-Ошера) для всех частиц ячейки cell
+     * 
+     * velocity_ext хранит смещение частицы от начала подшага, поэтому начальное положение x0 = location - velocity_ext не запоминается отдельно.
+     * Новое положение x0 + (1 - start_weight) * (location - x0 + dt * v), velocity_ext = новое смещение от x0, где dt = time_step / get_movement_steps().
+     * Первая стадия выполняется advect_in_cell(), после последней стадии velocity_ext - полное смещение за подшаг.
+     */
+    void advect_stage_in_cell(const typename Triangulation<3>::active_cell_iterator &cell, const pfem2CellNodeValues &node_velocities, const double time_step, const double start_weight);
+    
+    /*!
+     * \brief Стадия метода Рунге-Кутты для одной частицы (как в advect_stage_in_cell(); первая стадия подшага - при start_weight = 0 и нулевой velocity_ext)
+     * 
+     * node_velocities - узловые значения скорости в текущей ячейке частицы.
+     */
+    void advect_particle_stage(const unsigned int particle, const pfem2CellNodeValues &node_velocities, const double time_step, const double start_weight);
+    
+    /*!
+     * \brief Определение ячейки одной частицы после ее перемещения, начиная с текущей ячейки частицы
+     * 
+     * Номер ячейки и локальные координаты частицы обновляются сразу, массивы по ячейкам - при вызове update_cell_buckets().
+     * Частицы можно определять параллельно (каждый вызов изменяет только данные своей частицы).
+     * \return Номер новой ячейки частицы (-1 - частица покинула расчетную область и остается в прежней ячейке до вызова remove_particle())
+     */
+    int relocate_particle(const unsigned int particle);
+    
+    unsigned int get_movement_steps (const unsigned int particle) const;
+    
+    //ячейки, содержащие вершину vertex: vertex_to_cell_indices[vertex_to_cell_offsets[vertex]] ... vertex_to_cell_indices[vertex_to_cell_offsets[vertex+1]-1]
+    std::vector<unsigned int> vertex_to_cell_offsets;
+    std::vector<unsigned int> vertex_to_cell_indices;
+    std::vector<unsigned char> vertex_to_cell_vertex_numbers;	//!< Локальные номера вершины в ячейках (в том же порядке, что и vertex_to_cell_indices)
+    std::vector<pfem2CellGeometry> cell_geometries;
+    pfem2CellSearchGrid cell_search_grid;
+    
+    /*!
+     * \brief Построение карт "вершина - ячейки", трилинейных отображений ячеек и сетки глобального поиска (вызывается до первой сортировки частиц)
+     */
     void initialize_maps();
     
+    /*!
+     * \brief Определение локальных координат точки p в ячейке с номером cell_index
+     */
+    pfem2PointLocation locate_point_in_cell(const int cell_index, const Point<3> &p, Point<3> &p_unit) const;
+    
 private:
+    /*!
+     * \brief Определение ячейки частицы, начиная с ячейки cell_index (общая часть sort_particles_into_subdomains_and_cells() и relocate_particle())
+     * 
+     * Частица, заведомо оставшаяся внутри ячейки, уточняет локальные координаты одним шагом метода Ньютона (incremental = true),
+     * остальные проверяются полным обратным отображением и при выходе из ячейки ищутся find_cell_for_particle().
+     * \return Запись о ячейке частицы (migration.cell == cell_index, если частица осталась в ячейке)
+     */
+    pfem2ParticleMigration locate_particle(const unsigned int particle, const int cell_index, bool &incremental) const;
+    
+    /*!
+     * \brief Поиск новой ячейки частицы обходом соседей через грани
+     * 
+     * На каждом шаге частица переходит в соседа через грань, за которую ее локальные координаты p_unit выходят дальше всего
+     * (грани на границе области пропускаются). Число шагов ограничено MAX_PARTICLE_WALK_STEPS.
+     * Если обход не привел к ячейке, содержащей частицу, выполняется глобальный поиск по cell_search_grid.
+     */
+    pfem2ParticleMigration find_cell_for_particle(const unsigned int particle, const typename Triangulation<3>::active_cell_iterator &cell, const Point<3> &p_unit) const;
+    
     SmartPointer<const parallel::distributed::Triangulation<3>, pfem2ParticleHandler> triangulation;
     SmartPointer<const Mapping<3>,pfem2ParticleHandler> mapping;
     
-    std::unordered_multimap<int, pfem2Particle*> particles;
+    pfem2ParticleArrays particles;					//!< Данные частиц, упорядоченные по ячейкам
+    pfem2ParticleArrays spare_particles;			//!< Запасной набор массивов для перестроения
+    
+    std::vector<unsigned int> free_slots;			//!< Места удаленных частиц, доступные для повторного использования
+    std::vector<unsigned int> cell_offsets;			//!< Начало диапазона частиц каждой ячейки (n_cells + 1 элементов)
+    std::vector<unsigned int> next_position;		//!< Рабочий массив сортировки подсчетом
+    
+    std::vector<std::vector<pfem2ParticleMigration>> migration_buffers;	//!< Буферы перемещений частиц (по одному на поток)
+    unsigned int last_sort_relocated;
+    unsigned int last_sort_deleted;
+    unsigned int last_sort_incremental;
+    
+    bool buckets_outdated;							//!< Признак наличия добавленных/удаленных/перемещенных частиц, не учтенных в cell_offsets
 
     unsigned int global_number_of_particles;
  
     unsigned int global_max_particles_per_cell;
 };
 
+/*!
+ * \brief Суммы величин частиц, объединяемых в одну (с коэффициентами - массами частиц)
+ */
+struct pfem2ParticleSums
+{
+	pfem2ParticleSums();
+	
+	Tensor<1,3> reference_location;
+	Tensor<1,3> velocity;
+	double salinity;
+	double mass;									//!< Сумма масс частиц
+	unsigned int count;
+};
+
+/*!
+ * \brief Результаты проверки ячеек на пустые и переполненные части, накопленные одним потоком
+ */
+struct pfem2ReseedBuffer
+{
+	std::vector<unsigned int> part_counts;			//!< Счетчики частиц в частях проверяемой ячейки
+	std::vector<unsigned int> part_survivors;		//!< Оставляемые частицы частей (по MAX_PARTICLES_PER_CELL_PART на часть, режим переменной плотности)
+	std::vector<pfem2ParticleSums> merge_sums;		//!< Суммы величин частиц, объединяемых с оставляемыми частицами
+	std::vector<pfem2Particle> particles;			//!< Частицы, подсеваемые в пустые части
+	std::vector<unsigned int> particle_cells;		//!< Номера ячеек подсеваемых частиц
+	std::vector<unsigned int> removed_particles;	//!< Индексы лишних частиц в переполненных частях
+	std::vector<unsigned int> changed_cells;		//!< Ячейки, в которых подсеваются или удаляются частицы
+	
+	void clear();
+};
+
 class pfem2Solver
 {
 public:
@@ -143,6 +488,13 @@ public:
 	 */
 	void seed_particles(const std::vector < unsigned int > & quantities);
 	
+	/*!
+	 * \brief Построение таблицы номеров степеней свободы в вершинах ячеек cell_dof_indices
+	 * 
+	 * Вызывается после setup_system() (и повторно при изменении сетки), до посева частиц.
+	 */
+	void initialize_cell_dof_indices();
+	
 	/*!
 	 * \brief Коррекция скоростей частиц по скоростям в узлах сетки
 	 * 
@@ -163,13 +515,43 @@ public:
 	/*!
 	 * \brief Перемещение частиц по известному полю скоростей в узлах
 	 * 
-	 * Перемещение происходит в форме 10 шагов (с шагом time_step/10). Предварительно в частицах корректируется и запоминается скорость. А затем на каждом шаге
+	 * Перемещение происходит в форме подшагов, число которых задается для каждой ячейки (compute_cell_movement_steps()) и запоминается частицами ее ячейки
+	 * (подшаг частицы - time_step/число подшагов). Первый подшаг выполняют все частицы, остальные - только частицы ячеек с большим числом подшагов
+	 * (advect_particles_substeps()). Предварительно в частицах корректируется и запоминается скорость. А затем на каждом подшаге
 	 * + обновляется информация о ячейке, которой принадлежит каждая частица (на первом шаге - за предварительного вычисления переносимой скорости);
 	 * + вычисляется скорость частиц по скоростям в узлах сетки (на первом шаге - за предварительного вычисления переносимой скорости);
-	 * + координаты частицы изменяются согласно формулам метода Эйлера.
+	 * + координаты частицы изменяются согласно формулам метода Эйлера (или метода Рунге-Кутты порядка particle_integration_order, см. advect_particles_stages()).
 	 */
 	void move_particles();
 	
+	/*!
+	 * \brief Число подшагов перемещения частиц каждой ячейки на текущем шаге по времени (заносится в cell_movement_steps)
+	 * 
+	 * Для каждой ячейки по скоростям в ее вершинах и обратной матрице Якоби оценивается смещение частиц за time_step в локальных координатах (число Куранта).
+	 * Число подшагов ячейки выбирается так, чтобы за один подшаг частицы смещались не более чем на MAX_PARTICLE_CFL размера ячейки,
+	 * и ограничено MAX_PARTICLES_MOVEMENT_STEPS. В ячейках с медленным течением выполняется один подшаг.
+	 * \return Наибольшее число подшагов по ячейкам
+	 */
+	unsigned int compute_cell_movement_steps();
+	
+	/*!
+	 * \brief Построение tria по сетке source с нумерацией ячеек и вершин вдоль кривой Гильберта
+	 * 
+	 * Ячейки упорядочиваются по номеру центра на кривой, вершины - в порядке первого появления в упорядоченных ячейках.
+	 * Степени свободы нумеруются distribute_dofs() в порядке обхода ячеек, а частицы хранятся упорядоченными по ячейкам,
+	 * поэтому они следуют тому же порядку без отдельной перенумерации. Номера материалов и границ сохраняются.
+	 */
+	void create_triangulation_along_curve(const Triangulation<3> &source);
+	
+	/*!
+	 * \brief Совмещенная обработка частиц на шаге по времени (заменяет последовательный вызов correct_particles_velocities(), move_particles() и distribute_particle_velocities_to_grid())
+	 * 
+	 * Коррекция скоростей частиц выполняется в том же проходе, что и первый шаг перемещения (узловые значения ячейки читаются один раз для всех ее частиц).
+	 * После последнего шага перемещения выполняются подсевание частиц и параллельная проекция на узлы (project_particles_to_grid()).
+	 * Время коррекции измеряется внутри совмещенного прохода, время всех четырех этапов накапливается в fused_stage_times и выводится на каждом шаге.
+	 */
+	void advance_particles();
+	
 	double time,time_step;							//!< Шаг решения задачи методом конечных элементов
 	int timestep_number;
 	
@@ -191,9 +573,90 @@ public:
 	
 	std::unordered_map<unsigned int, unsigned int> verticesDoFnumbers;
 	
+	bool adaptive_particle_density;					//!< Режим переменной плотности частиц
+	std::vector<unsigned int> min_quantities;		//!< Число частей спокойной ячейки по направлениям
+	double salinity_variation_threshold;			//!< Разброс солености в вершинах ячейки, начиная с которого используется полное число частиц
+	double velocity_variation_threshold;			//!< Разброс компоненты скорости в вершинах ячейки, начиная с которого используется полное число частиц
+	
+	unsigned int particle_integration_order;		//!< Порядок метода перемещения частиц: 1 - Эйлер, 2 - Хойн, 3 - SSP-RK3 (допустимые значения проверяются в CMakeLists.txt)
+	
+	std::vector<unsigned int> cell_dof_indices;		//!< Номера степеней свободы в вершинах ячеек: для вершины vertex ячейки cell - элемент cell->index() * 8 + vertex
+	
 protected:
 	void seed_particles_into_cell (const typename DoFHandler<3>::cell_iterator &cell);
-	bool check_cell_for_empty_parts (const typename DoFHandler<3>::cell_iterator &cell);
+	
+	/*!
+	 * \brief Проверка частей ячейки cell на наличие частиц (подсеваемые и удаляемые частицы заносятся в buffer)
+	 * 
+	 * Каждая ячейка делится на quantities[0] x quantities[1] x quantities[2] частей. В пустую часть подсевается 1 частица в центр,
+	 * из части, содержащей более MAX_PARTICLES_PER_CELL_PART частиц, лишние удаляются.
+	 * 
+	 * В режиме переменной плотности (adaptive_particle_density) спокойные ячейки делятся на min_quantities частей. Лишние частицы части
+	 * не отбрасываются, а объединяются с оставшимися (скорость, соленость и локальные координаты осредняются с весами-массами, массы складываются),
+	 * а подсеваемая частица получает скорость, соленость и половину массы ближайшей частицы ячейки (разделение). Поэтому суммарная масса частиц ячейки
+	 * и суммы массы, умноженной на скорость и соленость, при объединении и разделении сохраняются. Частица, подсеваемая без разделения,
+	 * получает массу, равную объему части в объемах частей при полном числе частиц (1 при постоянной плотности).
+	 * Изменяются только частицы ячейки cell, поэтому ячейки можно проверять параллельно.
+	 * \return true, если в ячейке есть подсеваемые или удаляемые частицы
+	 */
+	bool check_cell_for_empty_parts (const typename DoFHandler<3>::cell_iterator &cell, pfem2ReseedBuffer &buffer);
+	
+	/*!
+	 * \brief Признак ячейки, требующей полного числа частиц: разброс солености или компоненты скорости в вершинах превышает порог
+	 */
+	bool needs_fine_particles (const unsigned int cell_index) const;
+	
+	/*!
+	 * \brief Подсевание частиц в пустые части ячеек и удаление лишних частиц
+	 * 
+	 * Ячейки проверяются параллельно, результаты потоков объединяются в порядке номеров ячеек (сначала все удаления, затем все добавления,
+	 * так что подсеваемые частицы занимают места удаленных), поэтому результат не зависит от числа потоков. Номера измененных ячеек сохраняются в reseeded_cells.
+	 */
+	void reseed_particles();
+	
+	/*!
+	 * \brief Стадии 2...particle_integration_order метода Рунге-Кутты для первого подшага перемещения частиц (подшаг частицы - time_step / ее число подшагов)
+	 * 
+	 * Вызывается после первой стадии (advect_in_cell() и сортировки частиц). Перед каждой стадией частицы уже находятся в своих ячейках
+	 * с актуальными локальными координатами, поэтому скорость интерполируется по узловым значениям ячейки так же, как на первой стадии.
+	 * После каждой стадии частицы сортируются, числа перемещенных и удаленных частиц добавляются к relocated и deleted.
+	 */
+	void advect_particles_stages(const double time_step, unsigned int &relocated, unsigned int &deleted);
+	
+	/*!
+	 * \brief Подшаги 2...n перемещения частиц с числом подшагов n > 1 (вызывается после первого подшага всех частиц)
+	 * 
+	 * Такие частицы перемещаются независимо друг от друга (параллельно по частицам): после каждой стадии метода Рунге-Кутты
+	 * частица сразу определяет свою ячейку (pfem2ParticleHandler::relocate_particle()), а скорость следующей стадии интерполируется по узлам этой ячейки.
+	 * Поэтому промежуточные определения ячеек выполняются только для продолжающих перемещение частиц, а массивы по ячейкам перестраиваются один раз в конце.
+	 * Числа перемещенных и удаленных частиц добавляются к relocated и deleted.
+	 */
+	void advect_particles_substeps(unsigned int &relocated, unsigned int &deleted);
+	
+	std::vector<unsigned int> cell_movement_steps;	//!< Число подшагов перемещения частиц каждой ячейки на текущем шаге по времени
+	
+	std::vector<pfem2ReseedBuffer> reseed_buffers;	//!< Буферы проверки ячеек (по одному на поток)
+	std::vector<unsigned int> reseeded_cells;		//!< Ячейки, измененные при последнем вызове reseed_particles() (по возрастанию номеров)
+	
+	/*!
+	 * \brief Значения трех полей в вершинах ячейки cell
+	 */
+	void get_cell_node_values (const unsigned int cell_index, const Vector<double> &fieldX, const Vector<double> &fieldY,
+							   const Vector<double> &fieldZ, pfem2CellNodeValues &node_values) const;
+	
+	/*!
+	 * \brief Проекция скоростей и солености частиц на узлы сетки (общая часть distribute_particle_velocities_to_grid() и advance_particles())
+	 * 
+	 * Узловое значение - среднее значений частиц с весами (масса частицы) * (значение функции формы узла в точке частицы).
+	 * Сначала параллельно по ячейкам вычисляются вклады частиц каждой ячейки в ее вершины (cell_projection_sums),
+	 * затем параллельно по вершинам вклады собираются из содержащих вершину ячеек в порядке их номеров.
+	 * Каждый поток пишет только в собственные элементы, поэтому гонок нет и результат побитово не зависит от числа потоков.
+	 */
+	void project_particles_to_grid();
+	
+	std::vector<pfem2ProjectionSums> cell_projection_sums;	//!< Вклады частиц ячеек в их вершины (по 8 на ячейку), память сохраняется между шагами
+	
+	double fused_stage_times[4];					//!< Накопленное время этапов advance_particles(): коррекция, перемещение, подсевание, проекция
 	
 	double h;
 	
@@ -201,10 +664,6 @@ private:
 	std::vector < unsigned int > quantities;
 	int particleCount = 0;
 	time_t solutionTime, startTime;
-	
-	unsigned int projection_func_count;
 };
 
-bool compare_particle_association(const unsigned int a, const unsigned int b, const Tensor<1,3> &particle_direction, const std::vector<Tensor<1,3> > &center_directions);
-
 #endif // PFEM2PARTICLE_H
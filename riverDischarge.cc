@@ -23,14 +23,36 @@
 
 #include <deal.II/lac/solver_bicgstab.h>
 #include <deal.II/lac/precondition.h>
+#include <deal.II/lac/sparse_ilu.h>
+#include <deal.II/lac/solver_cg.h>
+#ifdef DEAL_II_WITH_TRILINOS
+#include <deal.II/lac/trilinos_precondition.h>
+#endif
+
+#include <deal.II/lac/constraint_matrix.h>
+
+#ifdef GEOMETRIC_MULTIGRID_PRESSURE
+#include <deal.II/multigrid/multigrid.h>
+#include <deal.II/multigrid/mg_transfer.h>
+#include <deal.II/multigrid/mg_tools.h>
+#include <deal.II/multigrid/mg_coarse.h>
+#include <deal.II/multigrid/mg_smoother.h>
+#include <deal.II/multigrid/mg_matrix.h>
+#include <deal.II/multigrid/mg_constrained_dofs.h>
+#endif
 #include <deal.II/lac/block_vector.h>
 #include <deal.II/lac/block_sparse_matrix.h>
 
 #include "pfem2particle.h"
+#include "pfem2amg.h"
+#ifdef MATRIX_FREE_OPERATORS
+#include "pfem2matrixfree.h"
+#endif
 
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include <memory>
 #include <stdlib.h>
 
 
@@ -58,6 +80,14 @@ double parabolicBC::value(const Point<3> &p, const unsigned int) const
 //	return 8.0;
 //}
 
+#ifdef MATRIX_FREE_OPERATORS
+typedef pfem2MatrixFreeOperator<1> VelocitySystemType;		//системы для компонент скорости без хранения матриц (MatrixFree)
+typedef pfem2MatrixFreeOperator<1> PressureSystemType;		//оператор Лапласа для давления без хранения матрицы
+#else
+typedef SparseMatrix<double> VelocitySystemType;
+typedef SparseMatrix<double> PressureSystemType;
+#endif
+
 class riverDischarge : public pfem2Solver
 {
 public:
@@ -66,7 +96,19 @@ public:
     void build_grid ();
     void setup_system();
     void initialize_node_solutions();
+    void assemble_operators();
+#ifdef MATRIX_FREE_OPERATORS
+    void assemble_explicit_terms();
+#endif
+    void assemble_prediction(const unsigned int component, VelocitySystemType &system_m, Vector<double> &system_r);
+    void assemble_correction(const unsigned int component, const Vector<double> &pressure_increment, VelocitySystemType &system_m, Vector<double> &system_r);
+    void apply_velocity_boundary_values(const std::map<types::global_dof_index,double> &boundary_values, VelocitySystemType &system_m, Vector<double> &solution, Vector<double> &system_r);
     void assemble_system();
+    void setup_pressure_solver();
+#ifdef GEOMETRIC_MULTIGRID_PRESSURE
+    void setup_pressure_multigrid();
+    void assemble_pressure_level_matrix(const unsigned int level, SparsityPattern &sparsity_pattern, SparseMatrix<double> &matrix);
+#endif
     void solveVx(bool correction = false);
     void solveVy(bool correction = false);
     void solveVz(bool correction = false);
@@ -75,14 +117,78 @@ public:
     void import_unv_mesh();
     void run();
     
-    SparsityPattern sparsity_patternVx, sparsity_patternVy,  sparsity_patternVz, sparsity_patternP;
-    SparseMatrix<double> system_mVx, system_mVy,  system_mVz, system_mP;
+    SparsityPattern sparsity_patternVx, sparsity_patternP;	//компоненты скорости используют один шаблон (DoFHandler'ы совпадают)
+    VelocitySystemType system_mVx, system_mVy,  system_mVz;
+    PressureSystemType system_mP;
     Vector<double> system_rVx, system_rVy,system_rVz, system_rP;
+    
+    //не зависящие от времени операторы (см. assemble_operators())
+#ifdef MATRIX_FREE_OPERATORS
+    std::shared_ptr<MatrixFree<3,double>> matrix_free;		//данные для обхода ячеек и граней: DoFHandler 0 - компоненты скорости, 1 - давление
+    pfem2MatrixFreeExplicitOperators<1> explicit_operators;	//явная часть tau_ij, градиент давления и дивергенция (вместо матриц операторов)
+    BlockVector<double> velocity_blocks;					//компоненты скорости - аргумент explicit_operators
+    BlockVector<double> explicit_termsV;					//явные части правых частей для прогноза компонент скорости (см. assemble_explicit_terms())
+    BlockVector<double> pressure_gradientV;					//градиент приращения давления для поправки компонент скорости
+#else
+    SparseMatrix<double> operator_mass;						//масса (N_i, N_j)
+    SparseMatrix<double> operator_viscous[3];				//неявная часть tau_ij для компоненты a: (grad N_i, grad N_j) + 1/3 (dN_i/dx_a, dN_j/dx_a)
+    SparseMatrix<double> operator_viscous_coupling[3][3];	//явная часть tau_ij: вклад компоненты c в уравнение для компоненты a (с потоком через границу)
+    SparseMatrix<double> operator_pressure_gradient[3];		//(N_i, dN_j/dx_a)
+    SparseMatrix<double> operator_laplace;					//(grad N_i, grad N_j)
+    SparseMatrix<double> operator_divergence[3];			//(dN_i/dx_a, N_j) - поток через границы 4 и 2
+    Vector<double> explicit_partV;							//явная часть правой части для прогноза компоненты скорости (см. assemble_prediction())
+#endif
+    Vector<double> shape_integrals;							//(N_i, 1)
+    
+    //система для давления с учетом ГУ не меняется по времени (см. setup_pressure_solver())
+    std::map<types::global_dof_index,double> boundary_valuesP;	//ГУ для давления (граница 3 и "открытое море")
+    Vector<double> boundary_liftingP;						//вклад исключенных ГУ в правую часть
+#if defined(GEOMETRIC_MULTIGRID_PRESSURE)
+    //геометрический многосеточный метод на иерархии глобально измельченной сетки (см. setup_pressure_multigrid())
+#ifdef MATRIX_FREE_OPERATORS
+    typedef pfem2MatrixFreeOperator<1> LevelMatrixTypeP;	//операторы уровней без хранения матриц
+#else
+    typedef SparseMatrix<double> LevelMatrixTypeP;
+#endif
+    typedef PreconditionChebyshev<LevelMatrixTypeP, Vector<double>> SmootherTypeP;
+    
+    MGConstrainedDoFs mg_constrained_dofsP;
+#ifdef MATRIX_FREE_OPERATORS
+    SparsityPattern mg_coarse_sparsity_patternP;
+    SparseMatrix<double> mg_coarse_matrixP;					//собранный оператор грубого уровня (для AMG)
+#else
+    MGLevelObject<SparsityPattern> mg_sparsity_patternsP;
+#endif
+    MGLevelObject<LevelMatrixTypeP> mg_matricesP;			//оператор Лапласа на уровнях (ГУ на границах 2 и 3 - нулевые)
+    MGTransferPrebuilt<Vector<double>> mg_transferP;
+    mg::Matrix<Vector<double>> mg_matrixP;
+    mg::SmootherRelaxation<SmootherTypeP, Vector<double>> mg_smootherP;	//сглаживатель Чебышева
+    std::unique_ptr<ReductionControl> mg_coarse_controlP;
+    std::unique_ptr<SolverCG<>> mg_coarse_solverP;
+    pfem2AMGPreconditioner mg_coarse_preconditionerP;		//грубый уровень (импортированная сетка) решается CG с AMG по собранной матрице
+    MGCoarseGridIterativeSolver<Vector<double>, SolverCG<>, SparseMatrix<double>, pfem2AMGPreconditioner> mg_coarseP;
+    std::unique_ptr<Multigrid<Vector<double>>> mgP;
+    std::unique_ptr<PreconditionMG<3, Vector<double>, MGTransferPrebuilt<Vector<double>>>> mg_preconditionerP;
+#else
+#ifdef MATRIX_FREE_OPERATORS
+    SparseMatrix<double> preconditioner_matrixP;			//собранный оператор Лапласа с ГУ - только для построения preconditionerP
+#endif
+#if defined(PRESSURE_AMG)
+#ifdef DEAL_II_WITH_TRILINOS
+    TrilinosWrappers::PreconditionAMG preconditionerP;		//AMG (Trilinos ML) для system_mP
+#else
+    pfem2AMGPreconditioner preconditionerP;				//AMG (сглаженная агрегация) для system_mP
+#endif
+#else
+    SparseILU<double> preconditionerP;						//неполное LU-разложение system_mP
+#endif
+#endif
     // const double theta;
     //  const double alpha;
     
 private:
     const double referenceSalinity = 20.0;
+    const double mu = 1e-3, g_z = 9.81, rho = 1000.0;
 };
 
 riverDischarge::riverDischarge()
@@ -93,6 +199,18 @@ riverDischarge::riverDischarge()
     time = 0.0;
     time_step = 0.1;
     timestep_number = 1;
+    
+#ifdef ADAPTIVE_PARTICLE_DENSITY
+    //в дальней зоне моря (без шлейфа пресной воды и заметных течений) - по одной части на ячейку
+    adaptive_particle_density = true;
+    min_quantities = {1, 1, 1};
+    salinity_variation_threshold = 0.01 * referenceSalinity;
+    velocity_variation_threshold = 0.01;
+#endif
+    
+#ifdef PARTICLE_INTEGRATION_ORDER
+    particle_integration_order = PARTICLE_INTEGRATION_ORDER;
+#endif
 }
 
 /*!
@@ -146,10 +264,25 @@ void riverDischarge::build_grid ()
 
 void riverDischarge::import_unv_mesh(){
     GridIn<3> gridin;
+#ifdef SPACE_FILLING_CURVE_ORDERING
+    Triangulation<3> unv_tria;
+    gridin.attach_triangulation(unv_tria);
+#else
     gridin.attach_triangulation(tria);
+#endif
     std::ifstream f("sea3d-whole2.unv");
     gridin.read_unv(f);
     
+#ifdef SPACE_FILLING_CURVE_ORDERING
+    create_triangulation_along_curve(unv_tria);
+#endif
+
+#ifdef GEOMETRIC_MULTIGRID_PRESSURE
+    //импортированная сетка - грубый уровень многосеточной иерархии
+    tria.refine_global(MESH_REFINEMENT_LEVELS);
+    std::cout << "Mesh refined " << MESH_REFINEMENT_LEVELS << " times, active cells: " << tria.n_active_cells() << std::endl;
+#endif
+    
     h = 1.0;
     
     /*GridOut grid_out;
@@ -176,14 +309,40 @@ void riverDischarge::setup_system()
     std::cout << "Number of degrees of freedom Vz: " << dof_handlerVz.n_dofs() << std::endl;
 
     dof_handlerP.distribute_dofs (feP);
+#ifdef GEOMETRIC_MULTIGRID_PRESSURE
+    dof_handlerP.distribute_mg_dofs ();
+#endif
     std::cout << "Number of degrees of freedom P: " << dof_handlerP.n_dofs() << std::endl;
     
-    //Vx
+#ifdef MATRIX_FREE_OPERATORS
+    {
+        //все компоненты скорости обходятся по dof_handlerVx (DoFHandler'ы совпадают)
+        ConstraintMatrix no_constraints;
+        no_constraints.close();
+        
+        const std::vector<const DoFHandler<3> *> dof_handlers = { &dof_handlerVx, &dof_handlerP };
+        const std::vector<const ConstraintMatrix *> constraints = { &no_constraints, &no_constraints };
+        const std::vector<QGauss<1>> quadratures (1, QGauss<1>(2));
+        
+        MatrixFree<3,double>::AdditionalData additional_data;
+        additional_data.mapping_update_flags = update_values | update_gradients | update_JxW_values;
+        additional_data.mapping_update_flags_boundary_faces = update_values | update_gradients | update_normal_vectors | update_JxW_values;
+        
+        matrix_free.reset (new MatrixFree<3,double>());
+        matrix_free->reinit (mapping, dof_handlers, constraints, quadratures, additional_data);
+    }
+#else
     DynamicSparsityPattern dspVx(dof_handlerVx.n_dofs());
     DoFTools::make_sparsity_pattern (dof_handlerVx, dspVx);
     sparsity_patternVx.copy_from(dspVx);
+#endif
     
+    //Vx
+#ifdef MATRIX_FREE_OPERATORS
+    system_mVx.initialize (matrix_free, 0);
+#else
     system_mVx.reinit (sparsity_patternVx);
+#endif
     solutionSal.reinit (dof_handlerVx.n_dofs());
     
     solutionVx.reinit (dof_handlerVx.n_dofs());
@@ -193,11 +352,11 @@ void riverDischarge::setup_system()
     system_rVx.reinit (dof_handlerVx.n_dofs());
     
     //Vy
-    DynamicSparsityPattern dspVy(dof_handlerVy.n_dofs());
-    DoFTools::make_sparsity_pattern (dof_handlerVy, dspVy);
-    sparsity_patternVy.copy_from(dspVy);
-    
-    system_mVy.reinit (sparsity_patternVy);
+#ifdef MATRIX_FREE_OPERATORS
+    system_mVy.initialize (matrix_free, 0);
+#else
+    system_mVy.reinit (sparsity_patternVx);
+#endif
     
     solutionVy.reinit (dof_handlerVy.n_dofs());
     predictionVy.reinit (dof_handlerVy.n_dofs());
@@ -206,11 +365,11 @@ void riverDischarge::setup_system()
     system_rVy.reinit (dof_handlerVy.n_dofs());
 
     //Vz
-    DynamicSparsityPattern dspVz(dof_handlerVz.n_dofs());
-    DoFTools::make_sparsity_pattern (dof_handlerVz, dspVz);
-    sparsity_patternVz.copy_from(dspVz);
-
-    system_mVz.reinit (sparsity_patternVz);
+#ifdef MATRIX_FREE_OPERATORS
+    system_mVz.initialize (matrix_free, 0);
+#else
+    system_mVz.reinit (sparsity_patternVx);
+#endif
 
     solutionVz.reinit (dof_handlerVz.n_dofs());
     predictionVz.reinit (dof_handlerVz.n_dofs());
@@ -219,15 +378,23 @@ void riverDischarge::setup_system()
     system_rVz.reinit (dof_handlerVz.n_dofs());
 
     //P
+#if !defined(MATRIX_FREE_OPERATORS) || !defined(GEOMETRIC_MULTIGRID_PRESSURE)
     DynamicSparsityPattern dspP(dof_handlerP.n_dofs());
     DoFTools::make_sparsity_pattern (dof_handlerP, dspP);
     sparsity_patternP.copy_from(dspP);
+#endif
     
+#ifdef MATRIX_FREE_OPERATORS
+    system_mP.initialize (matrix_free, 1);
+#else
     system_mP.reinit (sparsity_patternP);
+#endif
     
     solutionP.reinit (dof_handlerP.n_dofs());
     old_solutionP.reinit (dof_handlerP.n_dofs());
     system_rP.reinit (dof_handlerP.n_dofs());
+    
+    assemble_operators();
 }
 void riverDischarge::initialize_node_solutions()
 {
@@ -256,524 +423,591 @@ void riverDischarge::initialize_node_solutions()
 		}
 	}
 }
-void riverDischarge::assemble_system()
+/*!
+ * \brief Сборка не зависящих от времени матриц операторов (сетка неподвижна)
+ *
+ * Матрицы систем и правые части на каждом шаге по времени строятся из этих матриц линейными комбинациями
+ * и умножением на векторы решения (см. assemble_system()), без обхода ячеек.
+ * В режиме MATRIX_FREE_OPERATORS матрицы не хранятся: операторы вычисляются обходом ячеек и граней (explicit_operators, системы),
+ * здесь задаются только границы с потоками и вычисляются интегралы функций формы.
+ */
+void riverDischarge::assemble_operators()
 {
-    std::set<unsigned int> positiveVxDoFNumbers;
-    std::set<unsigned int> positiveVyDoFNumbers;
-    TimerOutput::Scope timer_section(*timer, "FEM step");
+#ifdef MATRIX_FREE_OPERATORS
+    //поток tau_ij через границу: для Vx и Vy - на границах 2 и 3, для Vz - только на границе 2;
+    //поток прогнозной скорости в уравнении для давления - на границах 4 и 2
+    const std::set<types::boundary_id> stress_flux_boundaries[3] = { {2, 3}, {2, 3}, {2} };
+    explicit_operators.initialize (matrix_free, stress_flux_boundaries, {4, 2});
     
-    old_solutionVx = solutionVx;
-    old_solutionVy = solutionVy;
-    old_solutionVz = solutionVz;
-    old_solutionP = solutionP;
-
+    velocity_blocks.reinit (3, dof_handlerVx.n_dofs());
+    explicit_termsV.reinit (3, dof_handlerVx.n_dofs());
+    pressure_gradientV.reinit (3, dof_handlerVx.n_dofs());
+    
+    Vector<double> unit (dof_handlerVx.n_dofs());
+    unit = 1.0;
+    shape_integrals.reinit (dof_handlerVx.n_dofs());
+    system_mVx.apply_mass (shape_integrals, unit);
+#else
     QGauss<3>   quadrature_formula(2);
     QGauss<2>   face_quadrature_formula(2);
     
-    FEValues<3> feVx_values (feVx, quadrature_formula, update_values | update_gradients | update_quadrature_points | update_JxW_values);
-    FEValues<3> feVy_values (feVy, quadrature_formula, update_values | update_gradients | update_quadrature_points | update_JxW_values);
-    FEValues<3> feVz_values (feVz, quadrature_formula, update_values | update_gradients | update_quadrature_points | update_JxW_values);
-    FEValues<3> feP_values (feP, quadrature_formula, update_values | update_gradients | update_quadrature_points | update_JxW_values);
-
-    FEFaceValues<3> feVx_face_values (feVx, face_quadrature_formula, update_values | update_gradients | update_quadrature_points | update_normal_vectors | update_JxW_values);
-    FEFaceValues<3> feVy_face_values (feVy, face_quadrature_formula, update_values | update_gradients | update_quadrature_points | update_normal_vectors | update_JxW_values);
-    FEFaceValues<3> feVz_face_values (feVz, face_quadrature_formula, update_values | update_gradients | update_quadrature_points | update_normal_vectors | update_JxW_values);
-    FEFaceValues<3> feP_face_values (feP, face_quadrature_formula, update_values | update_gradients | update_quadrature_points | update_normal_vectors | update_JxW_values);
-    const unsigned int   dofs_per_cellVx = feVx.dofs_per_cell,
-    dofs_per_cellVy = feVy.dofs_per_cell,
-    dofs_per_cellVz = feVz.dofs_per_cell,
-    dofs_per_cellP = feP.dofs_per_cell;
-    
-    const unsigned int   n_q_points = quadrature_formula.size();
-    const unsigned int n_face_q_points = face_quadrature_formula.size();
+    FEValues<3> fe_values (feVx, quadrature_formula, update_values | update_gradients | update_JxW_values);
+    FEFaceValues<3> fe_face_values (feVx, face_quadrature_formula, update_values | update_gradients | update_normal_vectors | update_JxW_values);
     
-    FullMatrix<double>   local_matrixVx (dofs_per_cellVx, dofs_per_cellVx),
-    local_matrixVy (dofs_per_cellVy, dofs_per_cellVy),
-    local_matrixVz (dofs_per_cellVz, dofs_per_cellVz),
-    local_matrixP (dofs_per_cellP, dofs_per_cellP);
+    const unsigned int dofs_per_cell = feVx.dofs_per_cell;
+    const unsigned int n_q_points = quadrature_formula.size();
+    const unsigned int n_face_q_points = face_quadrature_formula.size();
     
-    Vector<double>       local_rhsVx (dofs_per_cellVx),
-    local_rhsVy (dofs_per_cellVy),
-    local_rhsVz (dofs_per_cellVz),
-    local_rhsP (dofs_per_cellP);
+    operator_mass.reinit (sparsity_patternVx);
+    for (unsigned int a = 0; a < 3; ++a) operator_viscous[a].reinit (sparsity_patternVx);
+    operator_laplace.reinit (sparsity_patternP);
+    for (unsigned int a = 0; a < 3; ++a){
+        operator_pressure_gradient[a].reinit (sparsity_patternVx);
+        operator_divergence[a].reinit (sparsity_patternP);
+        
+        for (unsigned int c = 0; c < 3; ++c) operator_viscous_coupling[a][c].reinit (sparsity_patternVx);
+    }
+    shape_integrals.reinit (dof_handlerVx.n_dofs());
+    explicit_partV.reinit (dof_handlerVx.n_dofs());
     
-    std::vector<types::global_dof_index> local_dof_indicesVx (dofs_per_cellVx),
-    local_dof_indicesVy (dofs_per_cellVy),
-    local_dof_indicesVz (dofs_per_cellVz),
-    local_dof_indicesP (dofs_per_cellP);
+    FullMatrix<double> local_mass (dofs_per_cell, dofs_per_cell), local_laplace (dofs_per_cell, dofs_per_cell);
+    FullMatrix<double> local_viscous[3], local_pressure_gradient[3], local_divergence[3], local_viscous_coupling[3][3];
+    for (unsigned int a = 0; a < 3; ++a){
+        local_viscous[a].reinit (dofs_per_cell, dofs_per_cell);
+        local_pressure_gradient[a].reinit (dofs_per_cell, dofs_per_cell);
+        local_divergence[a].reinit (dofs_per_cell, dofs_per_cell);
+        
+        for (unsigned int c = 0; c < 3; ++c) local_viscous_coupling[a][c].reinit (dofs_per_cell, dofs_per_cell);
+    }
+    Vector<double> local_shape_integrals (dofs_per_cell);
     
-    const double mu = 1e-3,
-    g_z = 9.81,
-    rho = 1000.0;
+    std::vector<types::global_dof_index> local_dof_indices (dofs_per_cell);
     
-    for(int nOuterCorr = 0; nOuterCorr < 1; ++nOuterCorr){
-        system_mVx=0.0;
-        system_rVx=0.0;
-        system_mVy=0.0;
-        system_rVy=0.0;
-        system_mVz=0.0;
-        system_rVz=0.0;
-       // positiveVxDoFNumbers.clear();
-        /*---------------------------------------------Prediction Vx--------------------------------------------*/
-        {
-            DoFHandler<3>::active_cell_iterator cell = dof_handlerVx.begin_active();
-            DoFHandler<3>::active_cell_iterator endc = dof_handlerVx.end();
+    DoFHandler<3>::active_cell_iterator cell = dof_handlerVx.begin_active(), endc = dof_handlerVx.end();
+    for (; cell!=endc; ++cell) {
+        fe_values.reinit (cell);
+        
+        local_mass = 0.0;
+        local_laplace = 0.0;
+        for (unsigned int a = 0; a < 3; ++a){
+            local_viscous[a] = 0.0;
+            local_pressure_gradient[a] = 0.0;
+            local_divergence[a] = 0.0;
             
-            for (; cell!=endc; ++cell) {
-                feVx_values.reinit (cell);
-                feVy_values.reinit (cell);
-                feVz_values.reinit (cell);
-                feP_values.reinit (cell);
-                local_matrixVx = 0.0;
-                local_rhsVx = 0.0;
+            for (unsigned int c = 0; c < 3; ++c) local_viscous_coupling[a][c] = 0.0;
+        }
+        local_shape_integrals = 0.0;
+        
+        for (unsigned int q_index=0; q_index<n_q_points; ++q_index)
+            for (unsigned int i=0; i<dofs_per_cell; ++i) {
+                const double Ni = fe_values.shape_value (i,q_index);
+                const Tensor<1,3> Ni_grad = fe_values.shape_grad (i,q_index);
+                const double JxW = fe_values.JxW (q_index);
                 
-                for (unsigned int q_index=0; q_index<n_q_points; ++q_index)
-                    for (unsigned int i=0; i<dofs_per_cellVx; ++i) {
-                        const Tensor<0,3> Ni_vel = feVx_values.shape_value (i,q_index);
-                        const Tensor<1,3> Ni_vel_grad = feVx_values.shape_grad (i,q_index);
+                for (unsigned int j=0; j<dofs_per_cell; ++j) {
+                    const double Nj = fe_values.shape_value (j,q_index);
+                    const Tensor<1,3> Nj_grad = fe_values.shape_grad (j,q_index);
+                    
+                    local_mass(i,j) += Ni * Nj * JxW;
+                    local_laplace(i,j) += Ni_grad * Nj_grad * JxW;
+                    
+                    for (unsigned int a = 0; a < 3; ++a){
+                        //неявная часть tau_aa (с коэффициентом 4/3 при производной по направлению компоненты)
+                        local_viscous[a](i,j) += (Ni_grad * Nj_grad + 1.0/3.0 * Ni_grad[a] * Nj_grad[a]) * JxW;
+                        local_pressure_gradient[a](i,j) += Ni * Nj_grad[a] * JxW;
+                        local_divergence[a](i,j) += Ni_grad[a] * Nj * JxW;
                         
-                        for (unsigned int j=0; j<dofs_per_cellVx; ++j) {
-                            const Tensor<0,3> Nj_vel = feVx_values.shape_value (j,q_index);
-                            const Tensor<1,3> Nj_vel_grad = feVx_values.shape_grad (j,q_index);
+                        //явная часть tau_ij: вклад компоненты c в уравнение для компоненты a
+                        for (unsigned int c = 0; c < 3; ++c)
+                            if(c != a) local_viscous_coupling[a][c](i,j) -= (Ni_grad[c] * Nj_grad[a] - 2.0/3.0 * Ni_grad[a] * Nj_grad[c]) * JxW;
+                    }
+                }//j
+                
+                local_shape_integrals(i) += Ni * JxW;
+            }//i
+        
+        for (unsigned int face_number=0; face_number<GeometryInfo<3>::faces_per_cell; ++face_number){
+            if (!cell->face(face_number)->at_boundary()) continue;
+            
+            const unsigned int boundary_id = cell->face(face_number)->boundary_id();
+            
+            //поток tau_ij через границу: для Vx и Vy - на границах 2 и 3, для Vz - только на границе 2
+            const bool stress_flux[3] = { boundary_id == 2 || boundary_id == 3, boundary_id == 2 || boundary_id == 3, boundary_id == 2 };
+            //поток прогнозной скорости в уравнении для давления - на границах 4 и 2
+            const bool velocity_flux = boundary_id == 4 || boundary_id == 2;
+            
+            if (!stress_flux[0] && !stress_flux[2] && !velocity_flux) continue;
+            
+            fe_face_values.reinit (cell, face_number);
+            
+            for (unsigned int q_point=0; q_point<n_face_q_points; ++q_point){
+                const Tensor<1,3> normal = fe_face_values.normal_vector(q_point);
+                const double JxW = fe_face_values.JxW(q_point);
+                
+                for (unsigned int i=0; i<dofs_per_cell; ++i){
+                    const double Ni = fe_face_values.shape_value(i,q_point);
+                    
+                    for (unsigned int j=0; j<dofs_per_cell; ++j){
+                        const double Nj = fe_face_values.shape_value(j,q_point);
+                        const Tensor<1,3> Nj_grad = fe_face_values.shape_grad(j,q_point);
+                        
+                        for (unsigned int a = 0; a < 3; ++a){
+                            //tau_ab * n_b = (dVa/dxb + dVb/dxa - 2/3 delta_ab div V) * n_b
+                            if(stress_flux[a])
+                                for (unsigned int c = 0; c < 3; ++c)
+                                    local_viscous_coupling[a][c](i,j) += Ni * ((a == c ? Nj_grad * normal : 0.0) + normal[c] * Nj_grad[a] - 2.0/3.0 * normal[a] * Nj_grad[c]) * JxW;
+                            
+                            if(velocity_flux) local_divergence[a](i,j) -= Ni * Nj * normal[a] * JxW;
+                        }
+                    }//j
+                }//i
+            }//q_point
+        }//face_number
+        
+        cell->get_dof_indices (local_dof_indices);
+        
+        for (unsigned int i=0; i<dofs_per_cell; ++i){
+            for (unsigned int j=0; j<dofs_per_cell; ++j){
+                operator_mass.add (local_dof_indices[i], local_dof_indices[j], local_mass(i,j));
+                for (unsigned int a = 0; a < 3; ++a) operator_viscous[a].add (local_dof_indices[i], local_dof_indices[j], local_viscous[a](i,j));
+                operator_laplace.add (local_dof_indices[i], local_dof_indices[j], local_laplace(i,j));
+                
+                for (unsigned int a = 0; a < 3; ++a){
+                    operator_pressure_gradient[a].add (local_dof_indices[i], local_dof_indices[j], local_pressure_gradient[a](i,j));
+                    operator_divergence[a].add (local_dof_indices[i], local_dof_indices[j], local_divergence[a](i,j));
+                    
+                    for (unsigned int c = 0; c < 3; ++c) operator_viscous_coupling[a][c].add (local_dof_indices[i], local_dof_indices[j], local_viscous_coupling[a][c](i,j));
+                }
+            }
+            
+            shape_integrals(local_dof_indices[i]) += local_shape_integrals(i);
+        }
+    }//cell
+#endif
+}
+
+/*!
+ * \brief Подготовка системы для давления: матрица с учетом ГУ и предобусловливатель строятся один раз
+ *
+ * ГУ для давления (граница 3 и "открытое море") не зависят от времени, поэтому строки и столбцы system_mP исключаются один раз,
+ * а вклад исключения в правую часть запоминается в boundary_liftingP. На шаге по времени меняется только правая часть.
+ * В режиме MATRIX_FREE_OPERATORS system_mP - оператор Лапласа без хранения матрицы; собранная матрица нужна только ILU и AMG.
+ * Вызывается после initialize_node_solutions() (заполнение openSeaDoFs).
+ */
+void riverDischarge::setup_pressure_solver()
+{
+    TimerOutput::Scope timer_section(*timer, "Pressure solver setup");
+    
+    boundary_valuesP.clear();
+    VectorTools::interpolate_boundary_values (dof_handlerP, 3, ConstantFunction<3>(100000.0), boundary_valuesP);
+    for(std::unordered_map<unsigned int, double>::iterator it = openSeaDoFs.begin(); it != openSeaDoFs.end(); ++it)
+        boundary_valuesP[it->first] = 100000.0 - rho * g_z * it->second;// - 0.5 * rho * (old_solutionVx[it->first] * old_solutionVx[it->first] + old_solutionVy[it->first] * old_solutionVy[it->first] + old_solutionVz[it->first] * old_solutionVz[it->first]);
+    
+    boundary_liftingP.reinit (dof_handlerP.n_dofs());
+    Vector<double> boundary_solution (dof_handlerP.n_dofs());
+    
+#ifdef MATRIX_FREE_OPERATORS
+    Tensor<1,3> unit_diffusion;
+    for (unsigned int d = 0; d < 3; ++d) unit_diffusion[d] = 1.0;
+    
+    system_mP.set_coefficients (0.0, unit_diffusion);
+    system_mP.reset_boundary_values ();
+    system_mP.apply_boundary_values (boundary_valuesP, boundary_solution, boundary_liftingP);
+#else
+    system_mP = 0.0;
+    system_mP.add (1.0, operator_laplace);
+    
+    MatrixTools::apply_boundary_values (boundary_valuesP, system_mP, boundary_solution, boundary_liftingP);
+#endif
+    
+#if defined(GEOMETRIC_MULTIGRID_PRESSURE)
+    setup_pressure_multigrid();
+#else
+#ifdef MATRIX_FREE_OPERATORS
+    preconditioner_matrixP.reinit (sparsity_patternP);
+    MatrixCreator::create_laplace_matrix (mapping, dof_handlerP, QGauss<3>(2), preconditioner_matrixP);
+    {
+        Vector<double> preconditioner_solution (dof_handlerP.n_dofs()), preconditioner_rhs (dof_handlerP.n_dofs());
+        MatrixTools::apply_boundary_values (boundary_valuesP, preconditioner_matrixP, preconditioner_solution, preconditioner_rhs);
+    }
+    const SparseMatrix<double> &matrixP = preconditioner_matrixP;
+#else
+    const SparseMatrix<double> &matrixP = system_mP;
+#endif
+    
+#if defined(PRESSURE_AMG) && defined(DEAL_II_WITH_TRILINOS)
+    TrilinosWrappers::PreconditionAMG::AdditionalData amg_data;
+    amg_data.elliptic = true;
+    amg_data.higher_order_elements = false;
+    amg_data.smoother_sweeps = 2;
+    amg_data.aggregation_threshold = 0.02;
+    preconditionerP.initialize (matrixP, amg_data);
+#else
+    preconditionerP.initialize (matrixP);
+#endif
+#endif
+
+#if defined(PRESSURE_AMG) && !defined(DEAL_II_WITH_TRILINOS) && !defined(GEOMETRIC_MULTIGRID_PRESSURE)
+    std::cout << "AMG levels for P: " << preconditionerP.n_levels() << std::endl;
+#endif
+}
+
+#ifdef GEOMETRIC_MULTIGRID_PRESSURE
+/*!
+ * \brief Построение многосеточного предобусловливателя для давления на иерархии уровней сетки
+ *
+ * Сетка получена глобальным измельчением импортированной (см. import_unv_mesh()), поэтому границ между уровнями внутри области нет
+ * и интерфейсные матрицы не нужны. На всех уровнях используется оператор Лапласа с нулевыми ГУ на границах 2 и 3 (там, где для давления
+ * заданы ГУ на активном уровне), сглаживатель - многочлен Чебышева, грубый уровень решается CG с AMG.
+ * В режиме MATRIX_FREE_OPERATORS операторы уровней не хранят матриц (Чебышев использует их обратную диагональ),
+ * собирается только матрица грубого уровня для AMG.
+ */
+void riverDischarge::setup_pressure_multigrid()
+{
+    const unsigned int n_levels = tria.n_global_levels();
+    
+    mg_constrained_dofsP.clear();
+    mg_constrained_dofsP.initialize (dof_handlerP);
+    mg_constrained_dofsP.make_zero_boundary_constraints (dof_handlerP, {2, 3});
+    
+    mg_matricesP.resize (0, n_levels - 1);
+    
+#ifdef MATRIX_FREE_OPERATORS
+    Tensor<1,3> unit_diffusion;
+    for (unsigned int d = 0; d < 3; ++d) unit_diffusion[d] = 1.0;
+    
+    for (unsigned int level = 0; level < n_levels; ++level){
+        ConstraintMatrix no_constraints;
+        no_constraints.close();
+        
+        MatrixFree<3,double>::AdditionalData additional_data;
+        additional_data.mapping_update_flags = update_gradients | update_JxW_values;
+        additional_data.level_mg_handler = level;
+        
+        std::shared_ptr<MatrixFree<3,double>> level_matrix_free (new MatrixFree<3,double>());
+        level_matrix_free->reinit (mapping, dof_handlerP, no_constraints, QGauss<1>(2), additional_data);
+        
+        mg_matricesP[level].initialize (level_matrix_free);
+        mg_matricesP[level].set_coefficients (0.0, unit_diffusion);
+        mg_matricesP[level].set_zero_boundary_values (mg_constrained_dofsP.get_boundary_indices(level));
+    }
+    
+    assemble_pressure_level_matrix (0, mg_coarse_sparsity_patternP, mg_coarse_matrixP);
+    const SparseMatrix<double> &coarse_matrix = mg_coarse_matrixP;
+#else
+    mg_sparsity_patternsP.resize (0, n_levels - 1);
+    for (unsigned int level = 0; level < n_levels; ++level) assemble_pressure_level_matrix (level, mg_sparsity_patternsP[level], mg_matricesP[level]);
+    
+    const SparseMatrix<double> &coarse_matrix = mg_matricesP[0];
+#endif
+    
+    mg_transferP.initialize_constraints (mg_constrained_dofsP);
+    mg_transferP.build_matrices (dof_handlerP);
+    
+    mg_matrixP.initialize (mg_matricesP);
+    
+    MGLevelObject<SmootherTypeP::AdditionalData> smoother_data (0, n_levels - 1);
+    for (unsigned int level = 0; level < n_levels; ++level){
+        smoother_data[level].smoothing_range = 15.0;
+        smoother_data[level].degree = 4;
+        smoother_data[level].eig_cg_n_iterations = 10;
+#ifdef MATRIX_FREE_OPERATORS
+        smoother_data[level].preconditioner = mg_matricesP[level].get_matrix_diagonal_inverse();
+#endif
+    }
+    mg_smootherP.initialize (mg_matricesP, smoother_data);
+    
+    //решение на грубом уровне должно быть точным, чтобы предобусловливатель оставался линейным для внешнего CG
+    mg_coarse_preconditionerP.initialize (coarse_matrix);
+    mg_coarse_controlP.reset (new ReductionControl (1000, 1e-14, 1e-8));
+    mg_coarse_solverP.reset (new SolverCG<> (*mg_coarse_controlP));
+    mg_coarseP.initialize (*mg_coarse_solverP, coarse_matrix, mg_coarse_preconditionerP);
+    
+    mgP.reset (new Multigrid<Vector<double>> (mg_matrixP, mg_coarseP, mg_transferP, mg_smootherP, mg_smootherP));
+    mg_preconditionerP.reset (new PreconditionMG<3, Vector<double>, MGTransferPrebuilt<Vector<double>>> (dof_handlerP, *mgP, mg_transferP));
+    
+    std::cout << "Multigrid levels for P: " << n_levels << ", coarse level DoFs: " << dof_handlerP.n_dofs(0) << std::endl;
+}
+
+/*!
+ * \brief Сборка оператора Лапласа на уровне level с нулевыми ГУ на границах 2 и 3 (mg_constrained_dofsP должен быть инициализирован)
+ */
+void riverDischarge::assemble_pressure_level_matrix(const unsigned int level, SparsityPattern &sparsity_pattern, SparseMatrix<double> &matrix)
+{
+    DynamicSparsityPattern dsp (dof_handlerP.n_dofs(level));
+    MGTools::make_sparsity_pattern (dof_handlerP, dsp, level);
+    sparsity_pattern.copy_from (dsp);
+    matrix.reinit (sparsity_pattern);
+    
+    ConstraintMatrix boundary_constraints;
+    boundary_constraints.add_lines (mg_constrained_dofsP.get_boundary_indices(level));
+    boundary_constraints.close ();
+    
+    QGauss<3>   quadrature_formula(2);
+    FEValues<3> fe_values (feP, quadrature_formula, update_gradients | update_JxW_values);
+    
+    const unsigned int dofs_per_cell = feP.dofs_per_cell;
+    const unsigned int n_q_points = quadrature_formula.size();
+    
+    FullMatrix<double> cell_matrix (dofs_per_cell, dofs_per_cell);
+    std::vector<types::global_dof_index> local_dof_indices (dofs_per_cell);
+    
+    DoFHandler<3>::level_cell_iterator cell = dof_handlerP.begin_mg(level), endc = dof_handlerP.end_mg(level);
+    for (; cell!=endc; ++cell) {
+        fe_values.reinit (cell);
+        cell_matrix = 0.0;
+        
+        for (unsigned int q_index=0; q_index<n_q_points; ++q_index)
+            for (unsigned int i=0; i<dofs_per_cell; ++i)
+                for (unsigned int j=0; j<dofs_per_cell; ++j)
+                    cell_matrix(i,j) += fe_values.shape_grad (i,q_index) * fe_values.shape_grad (j,q_index) * fe_values.JxW (q_index);
+        
+        cell->get_mg_dof_indices (local_dof_indices);
+        boundary_constraints.distribute_local_to_global (cell_matrix, local_dof_indices, matrix);
+    }//cell
+}
+#endif
+
+#ifdef MATRIX_FREE_OPERATORS
+/*!
+ * \brief Явные части правых частей для прогноза всех компонент скорости: явная часть tau_ij (вместе с потоком через границы 2 и 3)
+ * и градиент давления (схема B) вычисляются одним обходом ячеек и граней для всех компонент
+ */
+void riverDischarge::assemble_explicit_terms()
+{
+    velocity_blocks.block(0) = old_solutionVx;
+    velocity_blocks.block(1) = old_solutionVy;
+    velocity_blocks.block(2) = old_solutionVz;
+    
+    explicit_operators.apply_viscous_coupling (explicit_termsV, velocity_blocks);
+    explicit_termsV *= mu/rho * time_step;
+    
 #ifdef SCHEMEB
-                            const Tensor<1,3> Nj_p_grad = feP_values.shape_grad (j,q_index);
+    explicit_operators.apply_pressure_gradient (pressure_gradientV, old_solutionP);
+    explicit_termsV.add (-time_step / rho, pressure_gradientV);
 #endif
-                            
-                            local_matrixVx(i,j) += Ni_vel * Nj_vel  * feVx_values.JxW(q_index);
-                            //implicit account for tau_ij
-                            local_matrixVx(i,j) += mu/rho * time_step * (4.0/3.0 * Ni_vel_grad[0] * Nj_vel_grad[0] + Ni_vel_grad[1] * Nj_vel_grad[1] + Ni_vel_grad[2] * Nj_vel_grad[2]) * feVx_values.JxW (q_index);
-                            
-                            //explicit account for tau_ij
-                            local_rhsVx(i) -= mu/rho * time_step * ((Ni_vel_grad[1] * Nj_vel_grad[0] - 2.0/3.0 * Ni_vel_grad[0] * Nj_vel_grad[1]) * old_solutionVy(cell->vertex_dof_index(j,0)) +
-                                    (Ni_vel_grad[2] * Nj_vel_grad[0] - 2.0/3.0 * Ni_vel_grad[0] * Nj_vel_grad[2]) * old_solutionVz(cell->vertex_dof_index(j,0))) * feVx_values.JxW (q_index);
-                            
+}
+#endif
+
+/*!
+ * \brief Матрица и правая часть системы для прогноза компоненты скорости component
+ *
+ * system_m = M + mu/rho * time_step * A, правая часть - M * V_old + явная часть tau_ij (вместе с потоком через границы 2 и 3) - градиент давления (схема B).
+ * В режиме MATRIX_FREE_OPERATORS явная часть берется из explicit_termsV (см. assemble_explicit_terms()).
+ */
+void riverDischarge::assemble_prediction(const unsigned int component, VelocitySystemType &system_m, Vector<double> &system_r)
+{
+    const Vector<double> *old_velocity[3] = { &old_solutionVx, &old_solutionVy, &old_solutionVz };
+    
+#ifdef MATRIX_FREE_OPERATORS
+    Tensor<1,3> diffusion;
+    for (unsigned int d = 0; d < 3; ++d) diffusion[d] = mu/rho * time_step * (d == component ? 4.0/3.0 : 1.0);
+    
+    system_m.set_coefficients (1.0, diffusion);
+    system_m.reset_boundary_values ();
+    
+    system_m.apply_mass (system_r, *old_velocity[component]);
+    system_r += explicit_termsV.block(component);
+#else
+    system_m = 0.0;
+    system_m.add (1.0, operator_mass);
+    system_m.add (mu/rho * time_step, operator_viscous[component]);
+    
+    operator_mass.vmult (system_r, *old_velocity[component]);
+    
+    explicit_partV = 0.0;
+    for (unsigned int c = 0; c < 3; ++c) operator_viscous_coupling[component][c].vmult_add (explicit_partV, *old_velocity[c]);
+    system_r.add (mu/rho * time_step, explicit_partV);
+    
 #ifdef SCHEMEB
-                            local_rhsVx(i) -= time_step / rho * Ni_vel * Nj_p_grad[0] * old_solutionP(cell->vertex_dof_index(j,0)) * feVx_values.JxW (q_index);
+    operator_pressure_gradient[component].vmult (explicit_partV, old_solutionP);
+    system_r.add (-time_step / rho, explicit_partV);
 #endif
-                            
-                            local_rhsVx(i) += Nj_vel * Ni_vel * old_solutionVx(cell->vertex_dof_index(j,0)) * feVx_values.JxW (q_index);
-                        }//j
-                    }//i
-
-                for (unsigned int face_number=0; face_number<GeometryInfo<3>::faces_per_cell; ++face_number)
-                    if (cell->face(face_number)->at_boundary() && (cell->face(face_number)->boundary_id() == 2 || cell->face(face_number)->boundary_id() == 3)){
-                        feVx_face_values.reinit(cell, face_number);
-                        feVy_face_values.reinit(cell, face_number);
-                        feVz_face_values.reinit(cell, face_number);
-
-                        for (unsigned int q_point = 0; q_point < n_face_q_points; ++q_point) {
-                            double tempX(0.0), tempY(0.0), tempZ(0.0);
-
-                            for (unsigned int i = 0; i < dofs_per_cellVx; ++i) {
-                                tempX += (4.0 / 3.0) * feVx_face_values.shape_grad(i, q_point)[0] * old_solutionVx(cell->vertex_dof_index(i, 0))
-                                          -(2.0 / 3.0) * feVy_face_values.shape_grad(i, q_point)[1] * old_solutionVy(cell->vertex_dof_index(i, 0))
-                                          -(2.0 / 3.0) * feVz_face_values.shape_grad(i, q_point)[2] * old_solutionVz(cell->vertex_dof_index(i, 0));
-
-                                tempY += feVx_face_values.shape_grad(i, q_point)[1] * old_solutionVx(cell->vertex_dof_index(i, 0))
-                                         + feVy_face_values.shape_grad(i, q_point)[0] * old_solutionVy(cell->vertex_dof_index(i, 0));
-
-                                tempZ += feVx_face_values.shape_grad(i, q_point)[2] * old_solutionVx(cell->vertex_dof_index(i, 0))
-                                         + feVy_face_values.shape_grad(i, q_point)[0] * old_solutionVz(cell->vertex_dof_index(i, 0));
-                            }
-                            
-                            for (unsigned int i = 0; i < dofs_per_cellVx; ++i)
-                                local_rhsVx(i) += (mu / rho) * time_step * feVy_face_values.shape_value(i, q_point) *
-                                                  (tempX * feVy_face_values.normal_vector(q_point)[0]
-                                                   + tempY * feVy_face_values.normal_vector(q_point)[1]
-                                                   + tempZ * feVy_face_values.normal_vector(q_point)[2]) *
-                                                  feVy_face_values.JxW(q_point);
-                        }
-                    }
+#endif
+}
 
-                cell->get_dof_indices (local_dof_indicesVx);
-                
-                for (unsigned int i=0; i<dofs_per_cellVx; ++i)
-                    for (unsigned int j=0; j<dofs_per_cellVx; ++j)
-                        system_mVx.add (local_dof_indicesVx[i], local_dof_indicesVx[j], local_matrixVx(i,j));
-                
-                for (unsigned int i=0; i<dofs_per_cellVx; ++i)
-                    system_rVx(local_dof_indicesVx[i]) += local_rhsVx(i);
-
-               /* for (unsigned int face_number=0; face_number<GeometryInfo<3>::faces_per_cell; ++face_number){
-                    if (cell->face(face_number)->at_boundary() && cell->face(face_number)->boundary_id() == 2) {
-                        feVx_face_values.reinit(cell, face_number);
-                        for (unsigned int q_point = 0; q_point < n_face_q_points; ++q_point) {
-                            for (unsigned int i = 0; i < dofs_per_cellVx; ++i) {
-                                if (old_solutionVx(cell->vertex_dof_index(i, 0)) * feVx_face_values.normal_vector(q_point)[0] < 0)
-                                    positiveVxDoFNumbers.insert(cell->vertex_dof_index(i, 0));
-                            }
-                        }
-                    }
-                }//special boundary condition*/
-            }//cell
+/*!
+ * \brief Матрица и правая часть системы для поправки компоненты скорости component по приращению давления pressure_increment
+ *
+ * В режиме MATRIX_FREE_OPERATORS градиент pressure_increment для всех компонент уже вычислен в pressure_gradientV.
+ */
+void riverDischarge::assemble_correction(const unsigned int component, const Vector<double> &pressure_increment, VelocitySystemType &system_m, Vector<double> &system_r)
+{
+#ifdef MATRIX_FREE_OPERATORS
+    system_m.set_coefficients (1.0, Tensor<1,3>());
+    system_m.reset_boundary_values ();
+    
+    (void)pressure_increment;
+    system_r = pressure_gradientV.block(component);
+#else
+    system_m = 0.0;
+    system_m.add (1.0, operator_mass);
+    
+    operator_pressure_gradient[component].vmult (system_r, pressure_increment);
+#endif
+    system_r *= -time_step / rho;
+}
+
+/*!
+ * \brief Исключение ГУ boundary_values из системы для компоненты скорости
+ */
+void riverDischarge::apply_velocity_boundary_values(const std::map<types::global_dof_index,double> &boundary_values, VelocitySystemType &system_m, Vector<double> &solution, Vector<double> &system_r)
+{
+#ifdef MATRIX_FREE_OPERATORS
+    system_m.apply_boundary_values (boundary_values, solution, system_r);
+#else
+    MatrixTools::apply_boundary_values (boundary_values, system_m, solution, system_r);
+#endif
+}
+
+void riverDischarge::assemble_system()
+{
+    std::set<unsigned int> positiveVxDoFNumbers;
+    std::set<unsigned int> positiveVyDoFNumbers;
+    TimerOutput::Scope timer_section(*timer, "FEM step");
+    
+    old_solutionVx = solutionVx;
+    old_solutionVy = solutionVy;
+    old_solutionVz = solutionVz;
+    old_solutionP = solutionP;
 
-        }//Vx
+    for(int nOuterCorr = 0; nOuterCorr < 1; ++nOuterCorr){
+#ifdef MATRIX_FREE_OPERATORS
+        assemble_explicit_terms();
+#endif
+       // positiveVxDoFNumbers.clear();
+        /*---------------------------------------------Prediction Vx--------------------------------------------*/
+        assemble_prediction (0, system_mVx, system_rVx);
         
         std::map<types::global_dof_index,double> boundary_valuesVx0;
         VectorTools::interpolate_boundary_values (dof_handlerVx, 4, parabolicBC(time), boundary_valuesVx0);
-        MatrixTools::apply_boundary_values (boundary_valuesVx0, system_mVx,    predictionVx,    system_rVx);
+        apply_velocity_boundary_values (boundary_valuesVx0, system_mVx,    predictionVx,    system_rVx);
         
         std::map<types::global_dof_index,double> boundary_valuesVx1;
         VectorTools::interpolate_boundary_values (dof_handlerVx, 1, ConstantFunction<3>(0.0), boundary_valuesVx1);
-        MatrixTools::apply_boundary_values (boundary_valuesVx1, system_mVx, predictionVx, system_rVx);
+        apply_velocity_boundary_values (boundary_valuesVx1, system_mVx, predictionVx, system_rVx);
 
        /* if(!positiveVxDoFNumbers.empty()){
             std::map<types::global_dof_index, double> boundary_valuesVx;
             for(std::set<unsigned int>::iterator num = positiveVxDoFNumbers.begin(); num != positiveVxDoFNumbers.end(); ++num) boundary_valuesVx[*num] = 0.0;
-            MatrixTools::apply_boundary_values (boundary_valuesVx, system_mVx, predictionVx, system_rVx);
+            apply_velocity_boundary_values (boundary_valuesVx, system_mVx, predictionVx, system_rVx);
         }*/
 
         solveVx();
 
         /*--------------------------------------------- Predicition Vy--------------------------------------------*/
        // positiveVyDoFNumbers.clear();
-        {
-            DoFHandler<3>::active_cell_iterator cell = dof_handlerVy.begin_active();
-            DoFHandler<3>::active_cell_iterator endc = dof_handlerVy.end();
-            
-            for (; cell!=endc; ++cell) {
-                feVx_values.reinit (cell);
-                feVy_values.reinit (cell);
-                feVz_values.reinit (cell);
-                feP_values.reinit (cell);
-                local_matrixVy = 0.0;
-                local_rhsVy = 0.0;
-                
-                for (unsigned int q_index=0; q_index<n_q_points; ++q_index) {
-                    for (unsigned int i=0; i<dofs_per_cellVy; ++i) {
-                        const Tensor<0,3> Ni_vel = feVy_values.shape_value (i,q_index);
-                        const Tensor<1,3> Ni_vel_grad = feVy_values.shape_grad (i,q_index);
-                        
-                        for (unsigned int j=0; j<dofs_per_cellVy; ++j) {
-                            const Tensor<0,3> Nj_vel = feVy_values.shape_value (j,q_index);
-                            const Tensor<1,3> Nj_vel_grad = feVy_values.shape_grad (j,q_index);
-#ifdef SCHEMEB
-                            const Tensor<1,3> Nj_p_grad = feP_values.shape_grad (j,q_index);
-#endif
-                            
-                            local_matrixVy(i,j) += Ni_vel * Nj_vel * feVy_values.JxW(q_index);
-                            //implicit account for tau_ij
-                            local_matrixVy(i,j) += (mu/rho) * time_step * (Nj_vel_grad[0] * Ni_vel_grad[0] + 4.0/3.0 * Ni_vel_grad[1] * Nj_vel_grad[1] + Ni_vel_grad[2] * Nj_vel_grad[2]) * feVy_values.JxW (q_index);
-                            
-                            //explicit account for tau_ij
-                            local_rhsVy(i) -= (mu/rho) * time_step * ((Ni_vel_grad[0] * Nj_vel_grad[1] - 2.0/3.0 * Ni_vel_grad[1] * Nj_vel_grad[0]) * old_solutionVx(cell->vertex_dof_index(j,0)) +
-                                    (Ni_vel_grad[2] * Nj_vel_grad[1] - 2.0/3.0 * Ni_vel_grad[1] * Nj_vel_grad[2]) * old_solutionVz(cell->vertex_dof_index(j,0))) * feVy_values.JxW (q_index);
-								
-                            local_rhsVy(i) += Nj_vel * Ni_vel * old_solutionVy(cell->vertex_dof_index(j,0))* feVy_values.JxW (q_index);
-
-#ifdef SCHEMEB                            
-                            local_rhsVy(i) -= time_step / rho * Ni_vel * Nj_p_grad[1] * old_solutionP(cell->vertex_dof_index(j,0)) * feVy_values.JxW (q_index);
-#endif
-                        }//j
-                    }//i
-                }//q_index
-
-                for (unsigned int face_number=0; face_number<GeometryInfo<3>::faces_per_cell; ++face_number)
-                    if (cell->face(face_number)->at_boundary() && (cell->face(face_number)->boundary_id() == 2 || cell->face(face_number)->boundary_id() == 3)){
-                        feVx_face_values.reinit (cell, face_number);
-                        feVy_face_values.reinit (cell, face_number);
-                        feVz_face_values.reinit (cell, face_number);
-
-                        for (unsigned int q_point=0; q_point<n_face_q_points; ++q_point){
-                            double tempX(0.0), tempY(0.0), tempZ(0.0);
-
-                            for (unsigned int i=0; i<dofs_per_cellVy; ++i){
-                                tempX += feVx_face_values.shape_grad(i,q_point)[1] * old_solutionVx(cell->vertex_dof_index(i,0))
-										 + feVy_face_values.shape_grad(i,q_point)[0] * old_solutionVy(cell->vertex_dof_index(i,0));
-
-                                tempY += (-2.0/3.0)*feVx_face_values.shape_grad(i,q_point)[0] * old_solutionVx(cell->vertex_dof_index(i,0))
-										  + (4.0/3.0)*feVy_face_values.shape_grad(i,q_point)[1] * old_solutionVy(cell->vertex_dof_index(i,0))
-                                          - (2.0/3.0)*feVz_face_values.shape_grad(i,q_point)[2] * old_solutionVz(cell->vertex_dof_index(i,0));
-                                tempZ += feVy_face_values.shape_grad(i,q_point)[2] * old_solutionVy(cell->vertex_dof_index(i,0))
-										 + feVz_face_values.shape_grad(i,q_point)[1] * old_solutionVz(cell->vertex_dof_index(i,0));
-
-                            }
-                            
-                            for (unsigned int i=0; i<dofs_per_cellVy; ++i)
-                                local_rhsVy(i) += (mu/rho) * time_step * feVy_face_values.shape_value(i,q_point) *
-												  (tempX * feVy_face_values.normal_vector(q_point)[0]
-												  + tempY * feVy_face_values.normal_vector(q_point)[1]
-												  + tempZ * feVy_face_values.normal_vector(q_point)[2]) *
-                                                  feVy_face_values.JxW(q_point);
-                        }
-                    }
-
-                cell->get_dof_indices (local_dof_indicesVy);
-                
-                for (unsigned int i=0; i<dofs_per_cellVy; ++i)
-                    for (unsigned int j=0; j<dofs_per_cellVy; ++j)
-                        system_mVy.add (local_dof_indicesVy[i], local_dof_indicesVy[j], local_matrixVy(i,j));
-                
-                for (unsigned int i=0; i<dofs_per_cellVy; ++i)
-                    system_rVy(local_dof_indicesVy[i]) += local_rhsVy(i);
-
-               /* for (unsigned int face_number=0; face_number<GeometryInfo<3>::faces_per_cell; ++face_number){
-                    if (cell->face(face_number)->at_boundary() && cell->face(face_number)->boundary_id() == 2) {
-                        feVx_face_values.reinit(cell, face_number);
-                        for (unsigned int q_point = 0; q_point < n_face_q_points; ++q_point) {
-                            for (unsigned int i = 0; i < dofs_per_cellVy; ++i) {
-                                if (old_solutionVy(cell->vertex_dof_index(i, 0)) * feVx_face_values.normal_vector(q_point)[1] < 0)
-                                    positiveVyDoFNumbers.insert(cell->vertex_dof_index(i, 0));
-                            }
-                        }
-                    }
-                }//special boundary condition*/
-            }//cell
-        }//Vy
+        assemble_prediction (1, system_mVy, system_rVy);
         
         std::map<types::global_dof_index,double> boundary_valuesVy0;
         VectorTools::interpolate_boundary_values (dof_handlerVy, 4, ConstantFunction<3>(0.0), boundary_valuesVy0);
-        MatrixTools::apply_boundary_values (boundary_valuesVy0, system_mVy, predictionVy, system_rVy);
+        apply_velocity_boundary_values (boundary_valuesVy0, system_mVy, predictionVy, system_rVy);
         
         std::map<types::global_dof_index,double> boundary_valuesVy1;
         VectorTools::interpolate_boundary_values (dof_handlerVy, 1, ConstantFunction<3>(0.0), boundary_valuesVy1);
-        MatrixTools::apply_boundary_values (boundary_valuesVy1, system_mVy, predictionVy, system_rVy);
+        apply_velocity_boundary_values (boundary_valuesVy1, system_mVy, predictionVy, system_rVy);
 
        /* if(!positiveVyDoFNumbers.empty()){
             std::map<types::global_dof_index, double> boundary_valuesVy;
             for(std::set<unsigned int>::iterator num = positiveVyDoFNumbers.begin(); num != positiveVyDoFNumbers.end(); ++num) boundary_valuesVy[*num] = 0.0;
-            MatrixTools::apply_boundary_values (boundary_valuesVy, system_mVy, predictionVy, system_rVy);
+            apply_velocity_boundary_values (boundary_valuesVy, system_mVy, predictionVy, system_rVy);
         }*/
 
         solveVy ();
 
         /*---------------------------------------------Prediction Vz--------------------------------------------*/
-
+        assemble_prediction (2, system_mVz, system_rVz);
+        
         {
-            DoFHandler<3>::active_cell_iterator cell = dof_handlerVz.begin_active();
-            DoFHandler<3>::active_cell_iterator endc = dof_handlerVz.end();
-
-            for (; cell!=endc; ++cell) {
-                feVx_values.reinit (cell);
-                feVy_values.reinit (cell);
-                feVz_values.reinit (cell);
-                feP_values.reinit (cell);
-                local_matrixVz = 0.0;
-                local_rhsVz = 0.0;
-
-                for (unsigned int q_index=0; q_index<n_q_points; ++q_index)
-                    for (unsigned int i=0; i<dofs_per_cellVz; ++i) {
-                        const Tensor<0,3> Ni_vel = feVz_values.shape_value (i,q_index);
-                        const Tensor<1,3> Ni_vel_grad = feVz_values.shape_grad (i,q_index);
-
-                        for (unsigned int j=0; j<dofs_per_cellVz; ++j) {
-                            const Tensor<0,3> Nj_vel = feVz_values.shape_value (j,q_index);
-                            const Tensor<1,3> Nj_vel_grad = feVz_values.shape_grad (j,q_index);
-#ifdef SCHEMEB
-                            const Tensor<1,3> Nj_p_grad = feP_values.shape_grad (j,q_index);
-#endif
-
-                            local_matrixVz(i,j) += Ni_vel * Nj_vel * feVz_values.JxW(q_index);
-                            //implicit account for tau_ij
-                            local_matrixVz(i,j) += (mu/rho) * time_step * (Nj_vel_grad[0] * Ni_vel_grad[0] + Nj_vel_grad[1] * Ni_vel_grad[1] + 4.0/3.0 * Ni_vel_grad[2] * Nj_vel_grad[2]) * feVz_values.JxW (q_index);
-
-                            //explicit account for tau_ij
-                            local_rhsVz(i) -= (mu/rho) * time_step * ((Ni_vel_grad[0] * Nj_vel_grad[2] - 2.0/3.0 * Ni_vel_grad[2] * Nj_vel_grad[0]) * old_solutionVx(cell->vertex_dof_index(j,0)) +
-                                    (Ni_vel_grad[1] * Nj_vel_grad[2] - 2.0/3.0 * Ni_vel_grad[2] * Nj_vel_grad[1]) * old_solutionVy(cell->vertex_dof_index(j,0))) * feVz_values.JxW (q_index);
-
-                            local_rhsVz(i) += (Nj_vel * Ni_vel * old_solutionVz(cell->vertex_dof_index(j,0)) -
-                                               time_step * g_z * (0.65/rho) * Ni_vel * Nj_vel * (solutionSal(cell->vertex_dof_index(j,0)) - referenceSalinity)) * feVz_values.JxW (q_index);
-
-#ifdef SCHEMEB
-                            local_rhsVz(i) -= time_step / rho * Ni_vel * Nj_p_grad[2] * old_solutionP(cell->vertex_dof_index(j,0)) * feVz_values.JxW (q_index);
+            //плавучесть: -time_step * g_z * (0.65/rho) * M * (S - S_ref) и сила тяжести -time_step * g_z * (N_i, 1)
+            const double buoyancy = time_step * g_z * (0.65/rho);
+            Vector<double> salinity_term (system_rVz.size());
+            
+#ifdef MATRIX_FREE_OPERATORS
+            system_mVz.apply_mass (salinity_term, solutionSal);
+#else
+            operator_mass.vmult (salinity_term, solutionSal);
 #endif
-                        }//j
-                        
-                        local_rhsVz(i) -= time_step * g_z * Ni_vel * feVz_values.JxW (q_index);
-                    }//i
-
-                for (unsigned int face_number=0; face_number<GeometryInfo<3>::faces_per_cell; ++face_number)
-                    if (cell->face(face_number)->at_boundary() && cell->face(face_number)->boundary_id() == 2){
-                        feVx_face_values.reinit (cell, face_number);
-                        feVy_face_values.reinit (cell, face_number);
-                        feVz_face_values.reinit (cell, face_number);
-
-                        for (unsigned int q_point=0; q_point<n_face_q_points; ++q_point){
-                            double tempX(0.0), tempY(0.0), tempZ(0.0);
-
-                            for (unsigned int i=0; i<dofs_per_cellVz; ++i){
-                                tempX += feVx_face_values.shape_grad(i,q_point)[2] * old_solutionVx(cell->vertex_dof_index(i,0))
-										 + feVz_face_values.shape_grad(i,q_point)[0] * old_solutionVz(cell->vertex_dof_index(i,0));
-
-                                tempY += feVy_face_values.shape_grad(i,q_point)[2] * old_solutionVy(cell->vertex_dof_index(i,0))
-										 + feVz_face_values.shape_grad(i,q_point)[1] * old_solutionVz(cell->vertex_dof_index(i,0));
-
-                                tempZ += (-2.0/3.0)*feVx_face_values.shape_grad(i,q_point)[0] * old_solutionVx(cell->vertex_dof_index(i,0))
-										 - (2.0/3.0)*feVy_face_values.shape_grad(i,q_point)[1] * old_solutionVy(cell->vertex_dof_index(i,0))
-										 + (4.0/3.0)*feVz_face_values.shape_grad(i,q_point)[2] * old_solutionVz(cell->vertex_dof_index(i,0));
-                            }
-                            
-                            for (unsigned int i=0; i<dofs_per_cellVz; ++i)
-                                local_rhsVz(i) += (mu/rho) * time_step * feVy_face_values.shape_value(i,q_point)*
-												  (tempX * feVz_face_values.normal_vector(q_point)[0]
-												  + tempY * feVz_face_values.normal_vector(q_point)[1]
-												  + tempZ * feVz_face_values.normal_vector(q_point)[2])
-												  * feVz_face_values.JxW(q_point);
-                        }
-                    }
-
-                cell->get_dof_indices (local_dof_indicesVz);
-
-                for (unsigned int i=0; i<dofs_per_cellVz; ++i)
-                    for (unsigned int j=0; j<dofs_per_cellVz; ++j)
-                        system_mVz.add (local_dof_indicesVz[i], local_dof_indicesVz[j], local_matrixVz(i,j));
-
-                for (unsigned int i=0; i<dofs_per_cellVz; ++i)
-                    system_rVz(local_dof_indicesVz[i]) += local_rhsVz(i);
-            }//cell
-        }//Vz
+            system_rVz.add (-buoyancy, salinity_term);
+            system_rVz.add (buoyancy * referenceSalinity - time_step * g_z, shape_integrals);
+        }
 
        std::map<types::global_dof_index,double> boundary_valuesVz0;
         VectorTools::interpolate_boundary_values (dof_handlerVz, 4, ConstantFunction<3>(-0.1), boundary_valuesVz0);
-        MatrixTools::apply_boundary_values (boundary_valuesVz0, system_mVz, predictionVz, system_rVz);
+        apply_velocity_boundary_values (boundary_valuesVz0, system_mVz, predictionVz, system_rVz);
 
         std::map<types::global_dof_index,double> boundary_valuesVz1;
         VectorTools::interpolate_boundary_values (dof_handlerVz, 1, ConstantFunction<3>(0.0), boundary_valuesVz1);
-        MatrixTools::apply_boundary_values (boundary_valuesVz1, system_mVz, predictionVz, system_rVz);
+        apply_velocity_boundary_values (boundary_valuesVz1, system_mVz, predictionVz, system_rVz);
 
         std::map<types::global_dof_index,double> boundary_valuesVz3;
         VectorTools::interpolate_boundary_values (dof_handlerVz, 3, ConstantFunction<3>(0.0), boundary_valuesVz3);
-        MatrixTools::apply_boundary_values (boundary_valuesVz3, system_mVz, predictionVz, system_rVz);
+        apply_velocity_boundary_values (boundary_valuesVz3, system_mVz, predictionVz, system_rVz);
 
         solveVz ();
 
         /*---------------------------------------------P--------------------------------------------*/
-            system_mP=0.0;
-            system_rP=0.0;
+#ifdef SCHEMEB
+#ifdef MATRIX_FREE_OPERATORS
+            system_mP.apply (system_rP, old_solutionP);		//действие оператора без учета ГУ
+#else
+            operator_laplace.vmult (system_rP, old_solutionP);
+#endif
+#else
+            system_rP = 0.0;
+#endif
             {
-                DoFHandler<3>::active_cell_iterator cell = dof_handlerP.begin_active();
-                DoFHandler<3>::active_cell_iterator endc = dof_handlerP.end();
+                //дивергенция прогнозной скорости (с потоком через границы 4 и 2)
+                Vector<double> divergence (system_rP.size());
                 
-                for (; cell!=endc; ++cell) {
-                    local_matrixP = 0.0;
-                    local_rhsP = 0.0;
-                    feVx_values.reinit (cell);
-                    feVy_values.reinit (cell);
-                    feVz_values.reinit (cell);
-                    feP_values.reinit (cell);
-                    
-                    for (unsigned int q_index=0; q_index<n_q_points; ++q_index) {
-                        for (unsigned int i=0; i<dofs_per_cellP; ++i) {
-                            const Tensor<1,3> Nidx_pres = feP_values.shape_grad (i,q_index);
-                            
-                            for (unsigned int j=0; j<dofs_per_cellP; ++j) {
-                                const Tensor<0,3> Nj_vel = feVx_values.shape_value (j,q_index);
-                                const Tensor<1,3> Njdx_pres = feP_values.shape_grad (j,q_index);
-                                
-                                local_matrixP(i,j) += Nidx_pres * Njdx_pres * feP_values.JxW(q_index);
-                                
-#ifdef SCHEMEB
-                                local_rhsP(i) += Nidx_pres * Njdx_pres * old_solutionP(cell->vertex_dof_index(j,0)) * feP_values.JxW(q_index);
+#ifdef MATRIX_FREE_OPERATORS
+                velocity_blocks.block(0) = predictionVx;
+                velocity_blocks.block(1) = predictionVy;
+                velocity_blocks.block(2) = predictionVz;
+                explicit_operators.apply_divergence (divergence, velocity_blocks);
+#else
+                operator_divergence[0].vmult_add (divergence, predictionVx);
+                operator_divergence[1].vmult_add (divergence, predictionVy);
+                operator_divergence[2].vmult_add (divergence, predictionVz);
 #endif
-                                local_rhsP(i) += rho / time_step * (predictionVx(cell->vertex_dof_index(j,0)) * Nidx_pres[0]
-																   + predictionVy(cell->vertex_dof_index(j,0)) * Nidx_pres[1]
-																   + predictionVz(cell->vertex_dof_index(j,0)) * Nidx_pres[2]) * Nj_vel * feP_values.JxW (q_index);
-                            }//j
-                        }//i
-                    }//q_index
-
-                    for (unsigned int face_number=0; face_number<GeometryInfo<3>::faces_per_cell; ++face_number)
-						if (cell->face(face_number)->at_boundary() && (cell->face(face_number)->boundary_id() == 4 || cell->face(face_number)->boundary_id() == 2)){
-                            feP_face_values.reinit (cell, face_number);
-                            feVx_face_values.reinit (cell, face_number);
-                            feVy_face_values.reinit (cell, face_number);
-                            feVz_face_values.reinit (cell, face_number);
-                            
-                            for (unsigned int q_point=0; q_point<n_face_q_points; ++q_point){
-                                double  Vx_q_point_value = 0.0,
-                                        Vy_q_point_value = 0.0,
-                                        Vz_q_point_value = 0.0;
-                                        
-                                for (unsigned int i=0; i<dofs_per_cellP; ++i){
-                                    Vx_q_point_value += feVx_face_values.shape_value(i,q_point) * predictionVx(cell->vertex_dof_index(i,0));
-                                    Vy_q_point_value += feVy_face_values.shape_value(i,q_point) * predictionVy(cell->vertex_dof_index(i,0));
-                                    Vz_q_point_value += feVz_face_values.shape_value(i,q_point) * predictionVz(cell->vertex_dof_index(i,0));
-                                }
-                                
-                                for (unsigned int i=0; i<dofs_per_cellP; ++i)
-                                    local_rhsP(i) -= rho / time_step * feP_face_values.shape_value(i,q_point) *
-													 (Vx_q_point_value * feP_face_values.normal_vector(q_point)[0]
-													 + Vy_q_point_value * feP_face_values.normal_vector(q_point)[1]
-													 + Vz_q_point_value * feP_face_values.normal_vector(q_point)[2]) * feP_face_values.JxW(q_point);
-                            }
-                        }
-
-                    cell->get_dof_indices (local_dof_indicesP);
-                    
-                    for (unsigned int i=0; i<dofs_per_cellP; ++i)
-                        for (unsigned int j=0; j<dofs_per_cellP; ++j)
-                            system_mP.add (local_dof_indicesP[i], local_dof_indicesP[j], local_matrixP(i,j));
-                    
-                    for (unsigned int i=0; i<dofs_per_cellP; ++i)
-                        system_rP(local_dof_indicesP[i]) += local_rhsP(i);
-                }//cell
-            }//P
+                system_rP.add (rho / time_step, divergence);
+            }
             
-            std::map<types::global_dof_index,double> boundary_valuesP1;
-            VectorTools::interpolate_boundary_values (dof_handlerP, 3, ConstantFunction<3>(100000.0), boundary_valuesP1);
-            MatrixTools::apply_boundary_values (boundary_valuesP1, system_mP, solutionP, system_rP);
-
-            std::map<types::global_dof_index,double> boundary_valuesP2;
-            for(std::unordered_map<unsigned int, double>::iterator it = openSeaDoFs.begin(); it != openSeaDoFs.end(); ++it)
-				boundary_valuesP2[it->first] = 100000.0 - rho * g_z * it->second;// - 0.5 * rho * (old_solutionVx[it->first] * old_solutionVx[it->first] + old_solutionVy[it->first] * old_solutionVy[it->first] + old_solutionVz[it->first] * old_solutionVz[it->first]);
-            MatrixTools::apply_boundary_values (boundary_valuesP2, system_mP, solutionP, system_rP);
+            //system_mP уже содержит ГУ: строки с ГУ в правой части заменяются, в остальные добавляется вклад исключенных столбцов
+            for(std::map<types::global_dof_index,double>::const_iterator it = boundary_valuesP.begin(); it != boundary_valuesP.end(); ++it){
+                system_rP(it->first) = 0.0;
+                solutionP(it->first) = it->second;
+            }
+            system_rP += boundary_liftingP;
             
             solveP ();
 
-        /*---------------------------------------------Correction Vx--------------------------------------------*/
-            {
-                system_mVx = 0.0;
-                system_rVx = 0.0;
-                
-                DoFHandler<3>::active_cell_iterator cell = dof_handlerVx.begin_active();
-                DoFHandler<3>::active_cell_iterator endc = dof_handlerVx.end();
-                
-                for (; cell!=endc; ++cell) {
-                    feVx_values.reinit (cell);
-                    feP_values.reinit (cell);
-                    local_matrixVx = 0.0;
-                    local_rhsVx = 0.0;
-                    
-                    for (unsigned int q_index=0; q_index<n_q_points; ++q_index)
-                        for (unsigned int i=0; i<dofs_per_cellVx; ++i) {
-                            const Tensor<0,3> Ni_vel = feVx_values.shape_value (i,q_index);
-                            
-                            for (unsigned int j=0; j<dofs_per_cellVx; ++j) {
-                                const Tensor<0,3> Nj_vel = feVx_values.shape_value (j,q_index);
-                                const Tensor<1,3> Nj_p_grad = feP_values.shape_grad (j,q_index);
-                                
-                                local_matrixVx(i,j) += Ni_vel * Nj_vel * feVx_values.JxW(q_index);
-                                
 #ifndef SCHEMEB
-                                local_rhsVx(i) -= time_step/rho * Ni_vel * Nj_p_grad[0] * solutionP(cell->vertex_dof_index(j,0)) * feVx_values.JxW (q_index);
+            const Vector<double> &pressure_increment = solutionP;
 #else
-								local_rhsVx(i) -= time_step/rho * Ni_vel * Nj_p_grad[0] * (solutionP(cell->vertex_dof_index(j,0)) - old_solutionP(cell->vertex_dof_index(j,0))) * feVx_values.JxW (q_index);
+            Vector<double> pressure_increment (solutionP);
+            pressure_increment -= old_solutionP;
+#endif
+#ifdef MATRIX_FREE_OPERATORS
+            explicit_operators.apply_pressure_gradient (pressure_gradientV, pressure_increment);
 #endif
-                            }//j
-                        }//i
-                    
-                    cell->get_dof_indices (local_dof_indicesVx);
-                    
-                    for (unsigned int i=0; i<dofs_per_cellVx; ++i)
-                        for (unsigned int j=0; j<dofs_per_cellVx; ++j)
-                            system_mVx.add (local_dof_indicesVx[i], local_dof_indicesVx[j], local_matrixVx(i,j));
-                    
-                    for (unsigned int i=0; i<dofs_per_cellVx; ++i)
-                        system_rVx(local_dof_indicesVx[i]) += local_rhsVx(i);
-                }//cell
+
+        /*---------------------------------------------Correction Vx--------------------------------------------*/
+            {
+                assemble_correction (0, pressure_increment, system_mVx, system_rVx);
 
                 std::map<types::global_dof_index,double> boundary_valuesVx0;
                 VectorTools::interpolate_boundary_values (dof_handlerVx, 4, ConstantFunction<3>(0.0), boundary_valuesVx0);
-                MatrixTools::apply_boundary_values (boundary_valuesVx0, system_mVx,  correctionVx,    system_rVx);
+                apply_velocity_boundary_values (boundary_valuesVx0, system_mVx,  correctionVx,    system_rVx);
 
                 std::map<types::global_dof_index,double> boundary_valuesVx1;
                 VectorTools::interpolate_boundary_values (dof_handlerVx, 1, ConstantFunction<3>(0.0), boundary_valuesVx1);
-                MatrixTools::apply_boundary_values (boundary_valuesVx1, system_mVx, correctionVx, system_rVx);
+                apply_velocity_boundary_values (boundary_valuesVx1, system_mVx, correctionVx, system_rVx);
 
                 if(!positiveVxDoFNumbers.empty()){
                     std::map<types::global_dof_index,double> boundary_valuesVx;
                     for(std::set<unsigned int>::iterator num = positiveVxDoFNumbers.begin(); num != positiveVxDoFNumbers.end(); ++num) boundary_valuesVx[*num] = 0.0;
-                    MatrixTools::apply_boundary_values (boundary_valuesVx, system_mVx, correctionVx, system_rVx) ;
+                    apply_velocity_boundary_values (boundary_valuesVx, system_mVx, correctionVx, system_rVx) ;
                 }
             }//Vx
             
@@ -781,115 +1015,39 @@ void riverDischarge::assemble_system()
 
         /*---------------------------------------------Correction Vy--------------------------------------------*/
             {
-                system_mVy = 0.0;
-                system_rVy = 0.0;
-                
-                DoFHandler<3>::active_cell_iterator cell = dof_handlerVy.begin_active();
-                DoFHandler<3>::active_cell_iterator endc = dof_handlerVy.end();
-                
-                for (; cell!=endc; ++cell) {
-                    feVy_values.reinit (cell);
-                    feP_values.reinit (cell);
-                    local_matrixVy = 0.0;
-                    local_rhsVy = 0.0;
-                    
-                    for (unsigned int q_index=0; q_index<n_q_points; ++q_index)
-                        for (unsigned int i=0; i<dofs_per_cellVy; ++i) {
-                            const Tensor<0,3> Ni_vel = feVy_values.shape_value (i,q_index);
-                            
-                            for (unsigned int j=0; j<dofs_per_cellVy; ++j) {
-                                const Tensor<0,3> Nj_vel = feVy_values.shape_value (j,q_index);
-                                const Tensor<1,3> Nj_p_grad = feP_values.shape_grad (j,q_index);
-                                
-                                local_matrixVy(i,j) += Ni_vel * Nj_vel * feVy_values.JxW(q_index);
-                                
-#ifndef SCHEMEB
-                                local_rhsVy(i) -= time_step/rho * Ni_vel * Nj_p_grad[1] * solutionP(cell->vertex_dof_index(j,0)) * feVy_values.JxW (q_index);
-#else
-								local_rhsVy(i) -= time_step/rho * Ni_vel * Nj_p_grad[1] * (solutionP(cell->vertex_dof_index(j,0)) - old_solutionP(cell->vertex_dof_index(j,0))) * feVy_values.JxW (q_index);
-#endif
-                            }//j
-                        }//i
-                    
-                    cell->get_dof_indices (local_dof_indicesVy);
-                    
-                    for (unsigned int i=0; i<dofs_per_cellVy; ++i)
-                        for (unsigned int j=0; j<dofs_per_cellVy; ++j)
-                            system_mVy.add (local_dof_indicesVy[i], local_dof_indicesVy[j], local_matrixVy(i,j));
-                    
-                    for (unsigned int i=0; i<dofs_per_cellVy; ++i)
-                        system_rVy(local_dof_indicesVy[i]) += local_rhsVy(i);
-                }//cell
+                assemble_correction (1, pressure_increment, system_mVy, system_rVy);
 
                 std::map<types::global_dof_index,double> boundary_valuesVy0;
                 VectorTools::interpolate_boundary_values (dof_handlerVy, 4, ConstantFunction<3>(0.0), boundary_valuesVy0);
-                MatrixTools::apply_boundary_values (boundary_valuesVy0, system_mVy, correctionVy, system_rVy);
+                apply_velocity_boundary_values (boundary_valuesVy0, system_mVy, correctionVy, system_rVy);
 
                 std::map<types::global_dof_index,double> boundary_valuesVy1;
                 VectorTools::interpolate_boundary_values (dof_handlerVy, 1, ConstantFunction<3>(0.0), boundary_valuesVy1);
-                MatrixTools::apply_boundary_values (boundary_valuesVy1, system_mVy, correctionVy, system_rVy);
+                apply_velocity_boundary_values (boundary_valuesVy1, system_mVy, correctionVy, system_rVy);
 
                 if(!positiveVyDoFNumbers.empty()){
                     std::map<types::global_dof_index,double> boundary_valuesVy;
                     for(std::set<unsigned int>::iterator num = positiveVyDoFNumbers.begin(); num != positiveVyDoFNumbers.end(); ++num) boundary_valuesVy[*num] = 0.0;
-                    MatrixTools::apply_boundary_values (boundary_valuesVy, system_mVy, correctionVy, system_rVy);
+                    apply_velocity_boundary_values (boundary_valuesVy, system_mVy, correctionVy, system_rVy);
                 }
             }//Vy
             solveVy (true);
 
         /*---------------------------------------------Correction Vz--------------------------------------------*/
         {
-            system_mVz = 0.0;
-            system_rVz = 0.0;
-
-            DoFHandler<3>::active_cell_iterator cell = dof_handlerVz.begin_active();
-            DoFHandler<3>::active_cell_iterator endc = dof_handlerVz.end();
-
-            for (; cell!=endc; ++cell) {
-                feVz_values.reinit (cell);
-                feP_values.reinit (cell);
-                local_matrixVz = 0.0;
-                local_rhsVz = 0.0;
-
-                for (unsigned int q_index=0; q_index<n_q_points; ++q_index)
-                    for (unsigned int i=0; i<dofs_per_cellVz; ++i) {
-                        const Tensor<0,3> Ni_vel = feVz_values.shape_value (i,q_index);
-
-                        for (unsigned int j=0; j<dofs_per_cellVz; ++j) {
-                            const Tensor<0,3> Nj_vel = feVz_values.shape_value (j,q_index);
-                            const Tensor<1,3> Nj_p_grad = feP_values.shape_grad (j,q_index);
-
-                            local_matrixVz(i,j) += Ni_vel * Nj_vel * feVz_values.JxW(q_index);
-
-#ifndef SCHEMEB
-                                local_rhsVz(i) -= time_step/rho * Ni_vel * Nj_p_grad[2] * solutionP(cell->vertex_dof_index(j,0)) * feVz_values.JxW (q_index);
-#else
-								local_rhsVz(i) -= time_step/rho * Ni_vel * Nj_p_grad[2] * (solutionP(cell->vertex_dof_index(j,0)) - old_solutionP(cell->vertex_dof_index(j,0))) * feVz_values.JxW (q_index);
-#endif
-                        }//j
-                    }//i
-
-                cell->get_dof_indices (local_dof_indicesVz);
-
-                for (unsigned int i=0; i<dofs_per_cellVz; ++i)
-                    for (unsigned int j=0; j<dofs_per_cellVz; ++j)
-                        system_mVz.add (local_dof_indicesVz[i], local_dof_indicesVz[j], local_matrixVz(i,j));
-
-                for (unsigned int i=0; i<dofs_per_cellVz; ++i)
-                    system_rVz(local_dof_indicesVz[i]) += local_rhsVz(i);
-            }//cell
+            assemble_correction (2, pressure_increment, system_mVz, system_rVz);
 
             std::map<types::global_dof_index,double> boundary_valuesVz0;
             VectorTools::interpolate_boundary_values (dof_handlerVz, 4, ConstantFunction<3>(0.0), boundary_valuesVz0);
-            MatrixTools::apply_boundary_values (boundary_valuesVz0, system_mVz, correctionVz, system_rVz);
+            apply_velocity_boundary_values (boundary_valuesVz0, system_mVz, correctionVz, system_rVz);
 
             std::map<types::global_dof_index,double> boundary_valuesVz1;
             VectorTools::interpolate_boundary_values (dof_handlerVz, 1, ConstantFunction<3>(0.0), boundary_valuesVz1);
-            MatrixTools::apply_boundary_values (boundary_valuesVz1, system_mVz, correctionVz, system_rVz);
+            apply_velocity_boundary_values (boundary_valuesVz1, system_mVz, correctionVz, system_rVz);
 
             std::map<types::global_dof_index,double> boundary_valuesVz3;
             VectorTools::interpolate_boundary_values (dof_handlerVz, 3, ConstantFunction<3>(0.0), boundary_valuesVz3);
-            MatrixTools::apply_boundary_values (boundary_valuesVz3, system_mVz, correctionVz, system_rVz);
+            apply_velocity_boundary_values (boundary_valuesVz3, system_mVz, correctionVz, system_rVz);
         }//Vz
 
         solveVz (true);
@@ -912,7 +1070,7 @@ void riverDischarge::solveVx(bool correction)
 {
     SolverControl solver_control (10000, 1e-12);
     SolverBicgstab<> solver (solver_control);
-    PreconditionJacobi<> preconditioner;
+    PreconditionJacobi<VelocitySystemType> preconditioner;
     
     preconditioner.initialize(system_mVx, 1.0);
     if(correction) solver.solve (system_mVx, correctionVx, system_rVx, preconditioner);
@@ -927,7 +1085,7 @@ void riverDischarge::solveVy(bool correction)
 {
     SolverControl solver_control (10000, 1e-12);
     SolverBicgstab<> solver (solver_control);
-    PreconditionJacobi<> preconditioner;
+    PreconditionJacobi<VelocitySystemType> preconditioner;
     
     preconditioner.initialize(system_mVy, 1.0);
     if(correction) solver.solve (system_mVy, correctionVy, system_rVy, preconditioner);
@@ -942,7 +1100,7 @@ void riverDischarge::solveVz(bool correction)
 {
     SolverControl solver_control (10000, 1e-12);
     SolverBicgstab<> solver (solver_control);
-    PreconditionJacobi<> preconditioner;
+    PreconditionJacobi<VelocitySystemType> preconditioner;
     preconditioner.initialize(system_mVz, 1.0);
     if(correction) solver.solve (system_mVz, correctionVz, system_rVz, preconditioner);
     else solver.solve (system_mVz, predictionVz, system_rVz, preconditioner);
@@ -954,13 +1112,22 @@ void riverDischarge::solveVz(bool correction)
 
 void riverDischarge::solveP()
 {
+#if defined(PRESSURE_AMG) || defined(GEOMETRIC_MULTIGRID_PRESSURE)
+    //system_mP симметрична и положительно определена (ГУ исключены симметрично), число итераций CG с AMG почти не зависит от размера сетки,
+    //поэтому кроме абсолютной точности 1e-12 задается уменьшение невязки в 1e10 раз
+    ReductionControl solver_control (10000, 1e-12, 1e-10);
+    SolverCG<> solver (solver_control);
+#else
     SolverControl solver_control (10000, 1e-12);
     SolverBicgstab<> solver (solver_control);
+#endif
     
-    PreconditionSSOR<> preconditioner;
-    
-    preconditioner.initialize(system_mP, 1.0);
-    solver.solve (system_mP, solutionP, system_rP, preconditioner);
+    //предобусловливатель построен один раз в setup_pressure_solver(), начальное приближение - давление с предыдущего шага
+#ifdef GEOMETRIC_MULTIGRID_PRESSURE
+    solver.solve (system_mP, solutionP, system_rP, *mg_preconditionerP);
+#else
+    solver.solve (system_mP, solutionP, system_rP, preconditionerP);
+#endif
     
     if(solver_control.last_check() == SolverControl::success)
         std::cout << "Solver for P converged with residual=" << solver_control.last_value() << ", no. of iterations=" << solver_control.last_step() << std::endl;
@@ -1007,9 +1174,8 @@ void riverDischarge::output_results(bool predictionCorrection)
     output2 << std::endl;
     output2 << "DATASET UNSTRUCTURED_GRID" << std::endl;
     output2 << "POINTS " << particle_handler.n_global_particles() << " float" << std::endl;
-    for(std::unordered_multimap<int, pfem2Particle*>::iterator particleIndex = particle_handler.begin();
-        particleIndex != particle_handler.end(); ++particleIndex){
-        output2 << (*particleIndex).second->get_location() << std::endl;
+    for(unsigned int particleIndex = particle_handler.begin(); particleIndex != particle_handler.end(); ++particleIndex){
+        output2 << particle_handler.get_location(particleIndex) << std::endl;
     }
     
     output2 << std::endl;
@@ -1027,13 +1193,13 @@ void riverDischarge::output_results(bool predictionCorrection)
     
     output2 << "POINT_DATA " << particle_handler.n_global_particles() << std::endl;
     output2 << "VECTORS velocity float" << std::endl;
-    for(auto particleIndex = particle_handler.begin(); particleIndex != particle_handler.end(); ++particleIndex){
-        output2 << (*particleIndex).second->get_velocity_component(0) << " " << (*particleIndex).second->get_velocity_component(1)
-        << " " << (*particleIndex).second->get_velocity_component(2)  << std::endl;
+    for(unsigned int particleIndex = particle_handler.begin(); particleIndex != particle_handler.end(); ++particleIndex){
+        output2 << particle_handler.get_velocity_component(particleIndex, 0) << " " << particle_handler.get_velocity_component(particleIndex, 1)
+        << " " << particle_handler.get_velocity_component(particleIndex, 2)  << std::endl;
     }
     
     output2 << "SCALARS salinity float" << std::endl << " LOOKUP_TABLE default" <<std::endl;
-    for(auto particleIndex = particle_handler.begin(); particleIndex != particle_handler.end(); ++particleIndex) output2 << (*particleIndex).second->get_salinity() << " ";
+    for(unsigned int particleIndex = particle_handler.begin(); particleIndex != particle_handler.end(); ++particleIndex) output2 << particle_handler.get_salinity(particleIndex) << " ";
     output2 << std::endl;
 }
 
@@ -1048,7 +1214,9 @@ void riverDischarge::run()
 
     import_unv_mesh();
     setup_system();
+    initialize_cell_dof_indices();
     initialize_node_solutions();
+    setup_pressure_solver();
     seed_particles({2, 2, 2});
 
 	particle_handler.initialize_maps();
@@ -1061,9 +1229,13 @@ void riverDischarge::run()
     for (; time<=200; time+=time_step, ++timestep_number) {
         std::cout << std::endl << "Time step " << timestep_number << " at t=" << time << std::endl;
         
+#ifdef FUSED_PARTICLE_STAGE
+        advance_particles();
+#else
         correct_particles_velocities();
         move_particles();
         distribute_particle_velocities_to_grid();
+#endif
                
         assemble_system();
         #ifdef SCHEMEB